@@ -0,0 +1,60 @@
+#ifndef INSTRUMENTEDSTORE_H
+#define INSTRUMENTEDSTORE_H
+
+#include "src/RamStore.h"
+
+// RamStore that counts backend calls and bytes so benchmarks can report I/O per operation.
+template <ps_offset_t Size>
+class InstrumentedStore : public RamStore<Size> {
+  mutable uint32_t _reads;
+  mutable uint32_t _readBytes;
+  uint32_t _writes;
+  uint32_t _writeBytes;
+
+public:
+  InstrumentedStore() {
+    resetCounters();
+  }
+
+  void resetCounters() {
+    _reads = 0;
+    _readBytes = 0;
+    _writes = 0;
+    _writeBytes = 0;
+  }
+  uint32_t reads() const { return _reads; }
+  uint32_t readBytes() const { return _readBytes; }
+  uint32_t writes() const { return _writes; }
+  uint32_t writeBytes() const { return _writeBytes; }
+
+protected:
+  virtual void readImpl(ps_offset_t offset, void *buf, uint16_t size) const {
+    ++_reads;
+    _readBytes += size;
+    RamStore<Size>::readImpl(offset, buf, size);
+  }
+  virtual void writeImpl(ps_offset_t offset, const void *buf, uint16_t size) {
+    ++_writes;
+    _writeBytes += size;
+    RamStore<Size>::writeImpl(offset, buf, size);
+  }
+  virtual void readvImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) const {
+    // Count a vectored call as the single transfer a native backend would make
+    ++_reads;
+    _readBytes += NonVolatileStore::spanBytes(spans, count);
+    for (uint8_t i=0; i<count; ++i) {
+      RamStore<Size>::readImpl(offset, spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+  }
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+    ++_writes;
+    _writeBytes += NonVolatileStore::spanBytes(spans, count);
+    for (uint8_t i=0; i<count; ++i) {
+      RamStore<Size>::writeImpl(offset, spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+  }
+};
+
+#endif
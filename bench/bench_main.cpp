@@ -0,0 +1,213 @@
+// Native benchmark of ParameterStore operations.
+// Build and run with:
+//   platformio run -e bench && .pio/build/bench/program > bench_output.txt
+// Prints one CSV row per operation and configuration. Compare runs to catch regressions.
+
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include "src/ParameterStore.h"
+#include "src/Snapshot.h"
+#include "src/ParameterSchema.h"
+#include "InstrumentedStore.h"
+
+#define STORE_SIZE 16000
+#define MAX_ENTRIES 64
+#define MAX_VALUE 64
+#define ROUNDS 50
+#define SCHEMA_SLOTS 8 // Keys given slots by the schema config
+
+typedef InstrumentedStore<STORE_SIZE> BenchStore;
+
+struct Config {
+  const char *name;
+  KeyIndex *index;
+  FreeSpaceMap *freeMap;
+  bool schema;
+  AllocationMode allocation;
+};
+
+struct Sample {
+  BenchStore *store;
+  uint32_t ops;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Fragmented stores hold a gap entry per key as well. Each line is key=hex\n
+static char serialized[2 * MAX_ENTRIES * (8 + 2 + 2 * MAX_VALUE) + 1];
+static uint8_t value[MAX_VALUE];
+// Each snapshot entry is key length, key, size, value
+static uint8_t snapshotted[2 * MAX_ENTRIES * (1 + 8 + 2 + MAX_VALUE) + 8];
+static size_t snapshotFill;
+static char slotNames[SCHEMA_SLOTS][16];
+
+static bool appendSnapshot(void *context, const char *bytes, size_t length) {
+  if ((snapshotFill + length)>sizeof(snapshotted)) {
+    return false;
+  }
+  memcpy(snapshotted + snapshotFill, bytes, length);
+  snapshotFill += length;
+  return true;
+}
+
+static void keyName(char *name, const char *prefix, const int i) {
+  sprintf(name, "%s%03d", prefix, i);
+}
+
+static void beginSample(Sample &sample, BenchStore &store) {
+  sample.store = &store;
+  sample.ops = 0;
+  store.resetCounters();
+  sample.start = std::chrono::steady_clock::now();
+}
+
+static void endSample(Sample &sample, const char *op, const char *config, const int entries, const int valueSize, const bool fragmented) {
+  const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - sample.start;
+  const double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  const double ops = sample.ops;
+  const BenchStore &store = *sample.store;
+  printf("%s,%s,%d,%d,%d,%.0f,%.1f,%.1f,%.1f,%.1f\n", op, config, entries, valueSize, (int)fragmented,
+    ns / ops, store.reads() / ops, store.writes() / ops, store.readBytes() / ops, store.writeBytes() / ops);
+}
+
+// Fill store with entries, optionally leaving a hole after each one.
+static void populate(ParameterStore &paramStore, const int entries, const int valueSize, const bool fragmented) {
+  char name[16];
+  for (int i=0; i<entries; ++i) {
+    keyName(name, "key", i);
+    paramStore.set(name, value, valueSize);
+    if (fragmented) {
+      keyName(name, "gap", i);
+      paramStore.set(name, value, 4);
+    }
+  }
+  if (fragmented) {
+    // Growing each gap entry moves it to the end and leaves a hole behind
+    for (int i=0; i<entries; ++i) {
+      keyName(name, "gap", i);
+      paramStore.set(name, value, 8);
+    }
+  }
+}
+
+static void run(const Config &config, const int entries, const int valueSize, const bool fragmented) {
+  const uint16_t slotSize = valueSize;
+  const ParameterSlot slots[SCHEMA_SLOTS] = {
+    { slotNames[0], slotSize }, { slotNames[1], slotSize }, { slotNames[2], slotSize }, { slotNames[3], slotSize },
+    { slotNames[4], slotSize }, { slotNames[5], slotSize }, { slotNames[6], slotSize }, { slotNames[7], slotSize },
+  };
+  FixedParameterSchema<SCHEMA_SLOTS> schema(slots);
+  ParameterSchema *const useSchema = config.schema ? &schema : NULL;
+  BenchStore store;
+  store.resetStore();
+  ParameterStore paramStore(store, config.index, config.freeMap, useSchema);
+  paramStore.setAllocation(config.allocation);
+  paramStore.begin();
+  populate(paramStore, entries, valueSize, fragmented);
+
+  char name[16];
+  Sample sample;
+
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r) {
+    for (int i=0; i<entries; ++i, ++sample.ops) {
+      keyName(name, "key", i);
+      paramStore.get(name, value, valueSize);
+    }
+  }
+  endSample(sample, "get", config.name, entries, valueSize, fragmented);
+
+  // Boot time pattern: every key at once
+  static char names[MAX_ENTRIES][16];
+  static uint8_t values[MAX_ENTRIES][MAX_VALUE];
+  std::vector<ParameterRequest> requests;
+  for (int i=0; i<entries; ++i) {
+    keyName(names[i], "key", i);
+    const ParameterRequest request = { names[i], values[i], (uint16_t)valueSize, 0 };
+    requests.push_back(request);
+  }
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r) {
+    paramStore.getMany(requests.data(), entries);
+    sample.ops += entries;
+  }
+  endSample(sample, "get_many", config.name, entries, valueSize, fragmented);
+
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r) {
+    for (int i=0; i<entries; ++i, ++sample.ops) {
+      keyName(name, "key", i);
+      value[0] = r;
+      paramStore.set(name, value, valueSize);
+    }
+  }
+  endSample(sample, "set", config.name, entries, valueSize, fragmented);
+
+  int size = 0;
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r, ++sample.ops) {
+    size = paramStore.serialize(serialized, sizeof(serialized));
+  }
+  endSample(sample, "serialize", config.name, entries, valueSize, fragmented);
+
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r, ++sample.ops) {
+    ParameterStore reopened(store, config.index, config.freeMap, useSchema);
+    reopened.begin();
+  }
+  endSample(sample, "begin", config.name, entries, valueSize, fragmented);
+
+  if (size>0) {
+    beginSample(sample, store);
+    for (int r=0; r<ROUNDS; ++r, ++sample.ops) {
+      paramStore.deserialize(serialized, size);
+    }
+    endSample(sample, "deserialize", config.name, entries, valueSize, fragmented);
+  }
+
+  beginSample(sample, store);
+  for (int r=0; r<ROUNDS; ++r, ++sample.ops) {
+    snapshotFill = 0;
+    paramStore.snapshot(appendSnapshot, NULL);
+  }
+  endSample(sample, "snapshot", config.name, entries, valueSize, fragmented);
+
+  beginSample(sample, store);
+  FixedSnapshotReader<MAX_VALUE> reader(paramStore);
+  for (int r=0; r<ROUNDS; ++r, ++sample.ops) {
+    reader.begin();
+    reader.write(snapshotted, snapshotFill);
+    reader.end();
+  }
+  endSample(sample, "restore", config.name, entries, valueSize, fragmented);
+}
+
+int main(int argc, char **argv) {
+  FixedKeyIndex<2 * MAX_ENTRIES + 1> index;
+  FixedFreeSpaceMap<2 * MAX_ENTRIES> freeMap;
+  const Config configs[] = {
+    { "plain", NULL, NULL, false, AllocateBestFit },
+    { "mapped", &index, &freeMap, false, AllocateBestFit },
+    { "schema", NULL, NULL, true, AllocateBestFit },
+    { "rotating", &index, &freeMap, false, AllocateRotating },
+  };
+  const int entryCounts[] = { 8, 32, 64 };
+  const int valueSizes[] = { 4, 16, 64 };
+
+  for (int i=0; i<SCHEMA_SLOTS; ++i) {
+    keyName(slotNames[i], "key", i);
+  }
+  for (unsigned i=0; i<sizeof(value); ++i) {
+    value[i] = rand() % 256;
+  }
+  printf("op,config,entries,value_size,fragmented,ns_per_op,reads_per_op,writes_per_op,read_bytes_per_op,write_bytes_per_op\n");
+  for (unsigned c=0; c<sizeof(configs)/sizeof(configs[0]); ++c) {
+    for (unsigned e=0; e<sizeof(entryCounts)/sizeof(entryCounts[0]); ++e) {
+      for (unsigned v=0; v<sizeof(valueSizes)/sizeof(valueSizes[0]); ++v) {
+        run(configs[c], entryCounts[e], valueSizes[v], false);
+        run(configs[c], entryCounts[e], valueSizes[v], true);
+      }
+    }
+  }
+  return 0;
+}
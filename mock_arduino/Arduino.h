@@ -22,6 +22,20 @@ typedef unsigned char   uint8_t;
 typedef unsigned short  uint16_t;
 typedef unsigned int    uint32_t;
 
+// Subset of Arduino's Print, enough to stream text out
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (n<size && write(buffer[n])==1) {
+      ++n;
+    }
+    return n;
+  }
+};
+
 void delay(uint16_t msec);
 
 void pinMode(uint8_t pin, uint8_t mode);
@@ -9,10 +9,11 @@
 
 class AdafruitFramSPIStore : public NonVolatileStore {
   Adafruit_FRAM_SPI &_fram;
-  const uint16_t _offset;
+  const ps_offset_t _offset;
+  static const uint16_t BurstSize = 64; // Largest vectored transfer gathered into one SPI command
 
 public:
-  AdafruitFramSPIStore(Adafruit_FRAM_SPI &fram, uint16_t size, uint16_t offset = 0)
+  AdafruitFramSPIStore(Adafruit_FRAM_SPI &fram, ps_offset_t size, ps_offset_t offset = 0)
     : NonVolatileStore(size), _fram(fram), _offset(offset) {
   }
 
@@ -23,13 +24,41 @@ public:
     return NonVolatileStore::begin();
   }
 protected:
-  virtual void readImpl(uint16_t offset, void *addr, uint16_t size) const {
+  virtual void readImpl(ps_offset_t offset, void *addr, uint16_t size) const {
     _fram.read(_offset + offset, (uint8_t *)addr, size);
   }
-  virtual void writeImpl(uint16_t offset, const void *bytes, uint16_t size) {
+  virtual void writeImpl(ps_offset_t offset, const void *bytes, uint16_t size) {
     _fram.writeEnable(true);
     _fram.write(_offset + offset, (uint8_t *)bytes, size);
     _fram.writeEnable(false);
   }
+  virtual void readvImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) const {
+    const uint16_t total = spanBytes(spans, count);
+    if (total>BurstSize) {
+      NonVolatileStore::readvImpl(offset, spans, count);
+      return;
+    }
+    uint8_t burst[BurstSize];
+    _fram.read(_offset + offset, burst, total);
+    uint16_t at = 0;
+    for (uint8_t i=0; i<count; ++i) {
+      memcpy(spans[i].addr, burst + at, spans[i].size);
+      at += spans[i].size;
+    }
+  }
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+    const uint16_t total = spanBytes(spans, count);
+    if (total>BurstSize) {
+      NonVolatileStore::writevImpl(offset, spans, count);
+      return;
+    }
+    uint8_t burst[BurstSize];
+    uint16_t at = 0;
+    for (uint8_t i=0; i<count; ++i) {
+      memcpy(burst + at, spans[i].addr, spans[i].size);
+      at += spans[i].size;
+    }
+    writeImpl(offset, burst, total);
+  }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef CACHEDSTORE_H
+#define CACHEDSTORE_H
+
+#include "NonVolatileStore.h"
+
+/*
+ * Read-through cache in front of another NonVolatileStore.
+ * Holds Pages aligned pages of PageSize bytes and serves reads from them so that
+ * walking entry headers costs one backing read per page instead of one per field.
+ * Writes go straight through to the backing store and update any cached copy.
+ * Least recently used page is replaced on a miss.
+ */
+template <uint16_t PageSize, uint8_t Pages>
+class CachedStore : public NonVolatileStore {
+  NonVolatileStore &_store;
+  mutable uint8_t _bytes[Pages][PageSize];
+  mutable ps_offset_t _page[Pages]; // Page number held by each slot
+  mutable uint32_t _used[Pages]; // Last use stamp, 0 means slot is empty
+  mutable uint32_t _clock;
+  mutable uint32_t _hits;
+  mutable uint32_t _misses;
+
+  ps_offset_t storeBytes() const {
+    return _store.size() + sizeof(uint32_t);
+  }
+
+  // Slot holding page, loading it from the backing store on a miss.
+  uint8_t slotFor(const ps_offset_t page) const {
+    uint8_t victim = 0;
+    for (uint8_t s=0; s<Pages; ++s) {
+      if (_used[s]!=0 && _page[s]==page) {
+        ++_hits;
+        _used[s] = ++_clock;
+        return s;
+      }
+      if (_used[s]<_used[victim]) {
+        victim = s;
+      }
+    }
+    ++_misses;
+    const ps_offset_t start = page * PageSize;
+    _store.readImpl(start, _bytes[victim], MIN(PageSize, (unsigned)(storeBytes() - start)));
+    _page[victim] = page;
+    _used[victim] = ++_clock;
+    return victim;
+  }
+
+public:
+  CachedStore(NonVolatileStore &store)
+    : NonVolatileStore(store.size() + sizeof(uint32_t)), _store(store),
+      _clock(0), _hits(0), _misses(0) {
+    invalidate();
+  }
+
+  virtual bool begin() {
+    invalidate();
+    return _store.begin();
+  }
+
+  virtual void resetStore() {
+    _store.resetStore();
+    invalidate();
+  }
+
+  virtual void sync() {
+    _store.sync();
+  }
+
+  // Drop all cached pages, e.g. after the backing store was written directly.
+  void invalidate() {
+    memset(_used, 0, sizeof(_used));
+  }
+
+  uint32_t hits() const { return _hits; }
+  uint32_t misses() const { return _misses; }
+  void resetCounters() {
+    _hits = 0;
+    _misses = 0;
+  }
+
+protected:
+  virtual void readImpl(ps_offset_t offset, void *addr, uint16_t size) const {
+    uint8_t *out = (uint8_t *)addr;
+    while (size>0) {
+      const ps_offset_t page = offset / PageSize;
+      const uint16_t within = offset % PageSize;
+      const uint16_t n = MIN(size, (uint16_t)(PageSize - within));
+      memcpy(out, _bytes[slotFor(page)] + within, n);
+      out += n;
+      offset += n;
+      size -= n;
+    }
+  }
+  virtual void writeImpl(ps_offset_t offset, const void *bytes, uint16_t size) {
+    _store.writeImpl(offset, bytes, size);
+    refresh(offset, (const uint8_t *)bytes, size);
+  }
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+    _store.writevImpl(offset, spans, count);
+    for (uint8_t i=0; i<count; ++i) {
+      refresh(offset, (const uint8_t *)spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+  }
+  // Writes go straight through, so the backing bytes are always current
+  virtual const uint8_t *addressImpl(ps_offset_t offset) const {
+    return _store.addressImpl(offset);
+  }
+
+private:
+  // Update cached copies of any pages a write overlaps
+  void refresh(const ps_offset_t offset, const uint8_t *bytes, const uint16_t size) {
+    for (uint8_t s=0; s<Pages; ++s) {
+      if (_used[s]==0) {
+        continue;
+      }
+      const uint32_t start = (uint32_t)_page[s] * PageSize;
+      const uint32_t from = MAX(start, (uint32_t)offset);
+      const uint32_t to = MIN(start + PageSize, (uint32_t)offset + size);
+      if (from<to) {
+        memcpy(_bytes[s] + (from - start), bytes + (from - offset), to - from);
+      }
+    }
+  }
+};
+
+#endif
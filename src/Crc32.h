@@ -0,0 +1,25 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include "Arduino.h"
+
+// Lookup table used by psCrc32(). Define one of these to override the default.
+//   PS_CRC_NIBBLE  16 entry table, 64 bytes. Default on AVR.
+//   PS_CRC_BYTE    256 entry table, 1KB. Default elsewhere.
+//   PS_CRC_SLICE8  Byte table plus 7KB of RAM to process 8 bytes per step.
+#if !defined(PS_CRC_NIBBLE) && !defined(PS_CRC_BYTE) && !defined(PS_CRC_SLICE8)
+  #if defined(__AVR__)
+    #define PS_CRC_NIBBLE
+  #else
+    #define PS_CRC_BYTE
+  #endif
+#endif
+
+// Signature shared by the CRC used in each store format.
+typedef uint32_t (*CrcFunction)(uint32_t crc, const uint8_t *buffer, uint16_t size);
+
+// Standard CRC-32. Start with crc 0 and pass the result back in to continue,
+// so psCrc32(psCrc32(0, a), b) is the CRC of a followed by b.
+uint32_t psCrc32(uint32_t crc, const uint8_t *buffer, uint16_t size);
+
+#endif
@@ -0,0 +1,145 @@
+#include "Deserializer.h"
+
+// Value of hex digit h, or 0xFF if it isn't one.
+static uint8_t hexValue(const char h) {
+  if ('0' <= h && h <= '9') {
+    return h - '0';
+  }
+  else if ('A' <= h && h <= 'F') {
+    return h - 'A' + 10;
+  }
+  else if ('a' <= h && h <= 'f') {
+    return h - 'a' + 10;
+  }
+  else {
+    return 0xFF;
+  }
+}
+
+Deserializer::Deserializer(ParameterStore &store, uint8_t *value, uint16_t capacity)
+  : _store(store), _value(value), _capacity(capacity),
+    _keyLength(0), _valueLength(0), _state(StateKey), _highNibble(false), _ok(true), _full(false), _loading(false)
+{
+}
+
+bool Deserializer::begin(const bool keepOld) {
+  _loading = false;
+  _full = false;
+  _ok = false;
+  if (_store.inTransaction()) {
+    PS_LOG_ERROR(F("Can't load while a transaction is open" CR));
+    return false; // The caller's transaction is left open
+  }
+  if (!keepOld) {
+    _store.clear();
+  }
+  _keyLength = 0;
+  _valueLength = 0;
+  _state = StateKey;
+  _highNibble = false;
+  _full = !_store.beginLoad();
+  _ok = !_full;
+  _loading = true;
+  return true;
+}
+
+void Deserializer::fail() {
+  _ok = false;
+  _state = StateSkip;
+}
+
+void Deserializer::endLine() {
+  if (_state==StateValue) {
+    if (_highNibble) {
+      _ok = false; // Can't handle odd number of hex digits
+    }
+    else if (!_full) {
+      _key[_keyLength] = '\0';
+      const int result = _store.set(_key, _value, _valueLength);
+      _full = (result==PS_INSUFFICIENT_SPACE);
+      _ok = (result==PS_SUCCESS) && _ok;
+    }
+  }
+  else if (_state==StateKey && _keyLength>0) {
+    _ok = false; // No '='
+  }
+  // An empty line is allowed
+  _keyLength = 0;
+  _valueLength = 0;
+  _state = StateKey;
+  _highNibble = false;
+}
+
+bool Deserializer::write(const char *text, size_t length) {
+  if (!_loading) {
+    return false;
+  }
+  for (size_t i=0; i<length; ++i) {
+    const char c = text[i];
+    if (c=='\0') {
+      break; // End of the text, as serialize(char *, size_t) counts its terminator
+    }
+    if (c=='\n') {
+      endLine();
+      continue;
+    }
+    if (c=='\r') {
+      continue; // Allow CRLF line ends
+    }
+    switch (_state) {
+      case StateKey:
+        if (c=='=') {
+          if (_keyLength==0) {
+            fail();
+          }
+          else {
+            _state = StateValue;
+          }
+        }
+        else if (_keyLength<PS_MAX_KEY_LENGTH) {
+          _key[_keyLength++] = c;
+        }
+        else {
+          fail();
+        }
+        break;
+      case StateValue: {
+        const uint8_t n = hexValue(c);
+        if (n==0xFF) {
+          fail();
+        }
+        else if (!_highNibble) {
+          if (_valueLength>=_capacity) {
+            fail(); // Value too large for buffer
+            break;
+          }
+          _value[_valueLength] = n << 4;
+          _highNibble = true;
+        }
+        else {
+          _value[_valueLength++] |= n;
+          _highNibble = false;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  return _ok;
+}
+
+bool Deserializer::end() {
+  if (!_loading) {
+    return false;
+  }
+  _loading = false;
+  endLine();
+  if (_full) {
+    _store.abort();
+  }
+  else {
+    _store.commit();
+  }
+  return _ok;
+}
@@ -0,0 +1,60 @@
+#ifndef DESERIALIZER_H
+#define DESERIALIZER_H
+
+#include "ParameterStore.h"
+
+/*
+ * Push parser for the key=hex text written by serialize(). Feed it chunks of any
+ * size as they arrive, e.g. from a UART, and each complete line is loaded into the store
+ * with ParameterStore::beginLoad(). end() commits the load, replacing the old contents.
+ * Line state is kept between calls. Hex is decoded straight into the value buffer
+ * supplied by FixedDeserializer, so a value larger than that buffer fails its line.
+ * A failed line is skipped and later lines are still restored.
+ */
+class Deserializer {
+  enum State {
+    StateKey,
+    StateValue,
+    StateSkip, // Rest of a bad line
+  };
+  ParameterStore &_store;
+  uint8_t *_value;
+  const uint16_t _capacity;
+  char _key[PS_MAX_KEY_LENGTH + 1];
+  uint8_t _keyLength;
+  uint16_t _valueLength;
+  uint8_t _state;
+  bool _highNibble; // A digit of the next byte has been read
+  bool _ok;
+  bool _full; // Load ran out of space. end() abandons it.
+  bool _loading; // begin() opened the load
+
+  void endLine();
+  void fail();
+public:
+  // Start a load, ready for the first line. With keepOld, the old contents stay until
+  // end() and survive power failure, but old and new must fit in the store together.
+  // Otherwise the store is cleared first, so a power failure can lose both. Returns false,
+  // leaving the store alone, if a transaction is already open.
+  bool begin(const bool keepOld = true);
+  // Parse more text. A NUL ends the chunk, so the length serialize(char *, size_t) returns
+  // can be passed as it is. Returns false once any line has failed.
+  bool write(const char *text, size_t length);
+  // Finish a last line that has no newline and commit the load. Returns true if every
+  // line was stored. If full(), nothing was committed and the old contents remain.
+  bool end();
+  bool full() const { return _full; }
+protected:
+  Deserializer(ParameterStore &store, uint8_t *value, uint16_t capacity);
+};
+
+template <uint16_t ValueBytes>
+class FixedDeserializer : public Deserializer {
+  uint8_t _storage[ValueBytes];
+public:
+  FixedDeserializer(ParameterStore &store)
+    : Deserializer(store, _storage, ValueBytes) {
+  }
+};
+
+#endif
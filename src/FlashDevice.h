@@ -0,0 +1,29 @@
+#ifndef FLASHDEVICE_H
+#define FLASHDEVICE_H
+
+#include "NonVolatileStore.h"
+
+/*
+ * Raw NOR flash, such as an MCU's internal flash. Programming only clears bits, so bytes
+ * must be erased, a whole block at a time, before they can be written again.
+ * FlashLogStore turns one into a NonVolatileStore for ParameterStore.
+ */
+class FlashDevice {
+public:
+  virtual ~FlashDevice() {
+  }
+  virtual uint32_t size() const = 0;
+  virtual uint32_t eraseBlockSize() const = 0;
+  // Smallest unit that can be programmed. Writes start and end on a multiple of it.
+  virtual uint8_t writeGranularity() const = 0;
+  // Typical time to erase a block, for deciding when to call FlashLogStore::reclaim()
+  virtual uint32_t eraseMicros() const = 0;
+
+  virtual void read(uint32_t offset, void *buffer, uint16_t size) const = 0;
+  // Write to erased bytes
+  virtual void program(uint32_t offset, const void *bytes, uint16_t size) = 0;
+  // Set every byte of the block to 0xFF
+  virtual void erase(uint32_t block) = 0;
+};
+
+#endif
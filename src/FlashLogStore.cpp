@@ -0,0 +1,301 @@
+#include "ParameterStore.h"
+#include "FlashLogStore.h"
+
+const uint32_t SPARE = 0xFFFFFFFF; // Sequence of a block without a valid header
+const uint16_t EMPTY = 0xFFFF; // readRecord() of an erased slot
+const uint16_t DAMAGED = 0xFFFE; // readRecord() of a record cut short
+const uint16_t RECORD_OVERHEAD = sizeof(uint16_t) + sizeof(uint32_t);
+
+static uint16_t roundUp(const uint16_t size, const uint8_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+FlashLogStore::FlashLogStore(FlashDevice &flash, const ps_offset_t size, const uint16_t chunkSize, uint16_t *map)
+  : NonVolatileStore(size), _flash(flash), _chunkSize(chunkSize), _chunks((size + chunkSize - 1) / chunkSize), _map(map),
+    _blockSize(0), _blocks(0), _headerBytes(0), _recordBytes(0), _slotsPerBlock(0), _active(0), _next(0), _sequence(0), _erases(0)
+{
+}
+
+uint32_t FlashLogStore::slotAddress(const uint16_t slot) const {
+  return (slot / _slotsPerBlock) * _blockSize + _headerBytes + (slot % _slotsPerBlock) * _recordBytes;
+}
+
+uint32_t FlashLogStore::blockSequence(const uint16_t block) const {
+  uint32_t header[2];
+  _flash.read(block * _blockSize, header, sizeof(header));
+  const uint32_t sequence = ntohl(header[0]);
+  return (ntohl(header[1])==~sequence) ? sequence : SPARE;
+}
+
+bool FlashLogStore::isErased(const uint16_t block) const {
+  uint8_t buffer[32];
+  for (uint32_t done = 0; done<_blockSize; done += sizeof(buffer)) {
+    const uint16_t chunk = MIN(sizeof(buffer), _blockSize - done);
+    _flash.read(block * _blockSize + done, buffer, chunk);
+    for (uint16_t i=0; i<chunk; ++i) {
+      if (buffer[i]!=0xFF) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Chunk held by the record at slot, with its data copied to data. EMPTY or DAMAGED otherwise.
+uint16_t FlashLogStore::readRecord(const uint16_t slot, uint8_t *data) const {
+  uint8_t record[RECORD_OVERHEAD + PS_FLASH_MAX_CHUNK];
+  const uint16_t bytes = RECORD_OVERHEAD + _chunkSize;
+  _flash.read(slotAddress(slot), record, bytes);
+  bool erased = true;
+  for (uint16_t i=0; i<bytes && erased; ++i) {
+    erased = (record[i]==0xFF);
+  }
+  if (erased) {
+    return EMPTY;
+  }
+  const uint16_t chunk = (record[0] << 8) | record[1];
+  const uint8_t *crc = record + sizeof(uint16_t) + _chunkSize;
+  const uint32_t stored = ((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3];
+  if (chunk>=_chunks || stored!=psCrc32(0, record, sizeof(uint16_t) + _chunkSize)) {
+    return DAMAGED;
+  }
+  memcpy(data, record + sizeof(uint16_t), _chunkSize);
+  return chunk;
+}
+
+// Point the map at each record in block. Returns the slots used, including damaged ones.
+uint16_t FlashLogStore::replay(const uint16_t block) {
+  uint8_t data[PS_FLASH_MAX_CHUNK];
+  uint16_t used = 0;
+  for (uint16_t i=0; i<_slotsPerBlock; ++i) {
+    const uint16_t slot = block * _slotsPerBlock + i;
+    const uint16_t chunk = readRecord(slot, data);
+    if (chunk==EMPTY) {
+      break; // Records are appended in order
+    }
+    if (chunk!=DAMAGED) {
+      _map[chunk] = slot + 1;
+    }
+    used = i + 1;
+  }
+  return used;
+}
+
+void FlashLogStore::eraseBlock(const uint16_t block) {
+  _flash.erase(block);
+  ++_erases;
+}
+
+// Make the erased block active
+void FlashLogStore::start(const uint16_t block) {
+  uint8_t header[16];
+  memset(header, 0xFF, sizeof(header));
+  const uint32_t sequence = _sequence + 1;
+  const uint32_t words[] = { (uint32_t)htonl(sequence), (uint32_t)htonl(~sequence) };
+  memcpy(header, words, sizeof(words));
+  _flash.program(block * _blockSize, header, _headerBytes);
+  _sequence = sequence;
+  _active = block;
+  _next = 0;
+}
+
+// The active block is done. Carry on in the next spare block round from it. If that was
+// the last spare, erase the oldest block to make another.
+bool FlashLogStore::advance() {
+  uint16_t spare = _blocks;
+  uint16_t spares = 0;
+  uint16_t oldest = _blocks;
+  uint32_t oldestSequence = SPARE;
+  for (uint16_t i=1; i<=_blocks; ++i) {
+    const uint16_t block = (_active + i) % _blocks;
+    const uint32_t sequence = blockSequence(block);
+    if (sequence==SPARE) {
+      spare = (spares++==0) ? block : spare;
+    }
+    else if (sequence<oldestSequence) {
+      oldest = block;
+      oldestSequence = sequence;
+    }
+  }
+  if (spare==_blocks) {
+    PS_LOG_ERROR(F("Flash has no spare block. Write dropped." CR));
+    return false;
+  }
+  start(spare);
+  if (spares==1 && oldest<_blocks) {
+    collect(oldest); // On failure the block is kept, and the next advance finds no spare
+  }
+  return true;
+}
+
+// Copy the block's live records to the active block, then erase it. Returns false, keeping
+// the block, if a record couldn't be copied.
+bool FlashLogStore::collect(const uint16_t block) {
+  uint8_t data[PS_FLASH_MAX_CHUNK];
+  for (uint16_t i=0; i<_slotsPerBlock; ++i) {
+    const uint16_t slot = block * _slotsPerBlock + i;
+    const uint16_t chunk = readRecord(slot, data);
+    if (chunk<_chunks && _map[chunk]==slot + 1 && !appendRecord(chunk, data)) {
+      PS_LOG_ERROR(F("Flash block %d not reclaimed, live records remain" CR), block);
+      return false;
+    }
+  }
+  eraseBlock(block);
+  return true;
+}
+
+bool FlashLogStore::appendRecord(const uint16_t chunk, const uint8_t *data) {
+  // Each advance frees a block, and one with room for new records comes round within _blocks
+  for (uint16_t tries=0; _next==_slotsPerBlock; ++tries) {
+    if (tries==_blocks || !advance()) {
+      return false;
+    }
+  }
+  uint8_t record[RECORD_OVERHEAD + PS_FLASH_MAX_CHUNK + 8];
+  memset(record, 0xFF, _recordBytes);
+  record[0] = chunk >> 8;
+  record[1] = chunk;
+  memcpy(record + sizeof(uint16_t), data, _chunkSize);
+  const uint32_t crc = psCrc32(0, record, sizeof(uint16_t) + _chunkSize);
+  uint8_t *end = record + sizeof(uint16_t) + _chunkSize;
+  end[0] = crc >> 24;
+  end[1] = crc >> 16;
+  end[2] = crc >> 8;
+  end[3] = crc;
+  const uint16_t slot = _active * _slotsPerBlock + _next;
+  _flash.program(slotAddress(slot), record, _recordBytes);
+  ++_next;
+  _map[chunk] = slot + 1;
+  return true;
+}
+
+bool FlashLogStore::begin() {
+  _blockSize = _flash.eraseBlockSize();
+  const uint8_t unit = _flash.writeGranularity();
+  _headerBytes = roundUp(2 * sizeof(uint32_t), unit);
+  _recordBytes = roundUp(RECORD_OVERHEAD + _chunkSize, unit);
+  _blocks = _flash.size() / _blockSize;
+  _slotsPerBlock = (_blockSize - _headerBytes) / _recordBytes;
+  if (_blocks<2 || unit>8 || ((uint32_t)_blocks * _slotsPerBlock)>=DAMAGED || _chunks>=((uint32_t)(_blocks - 1) * _slotsPerBlock)) {
+    PS_LOG_ERROR(F("Flash too small for a store of %d chunks" CR), _chunks);
+    return false;
+  }
+
+  // Replay blocks oldest first, so that later records replace earlier ones
+  memset(_map, 0, _chunks * sizeof(_map[0]));
+  _active = _blocks;
+  _sequence = 0;
+  for (;;) {
+    uint16_t next = _blocks;
+    uint32_t nextSequence = SPARE;
+    for (uint16_t block=0; block<_blocks; ++block) {
+      const uint32_t sequence = blockSequence(block);
+      if (sequence!=SPARE && sequence>_sequence && sequence<nextSequence) {
+        next = block;
+        nextSequence = sequence;
+      }
+    }
+    if (next==_blocks) {
+      break;
+    }
+    _next = replay(next);
+    _active = next;
+    _sequence = nextSequence;
+  }
+
+  // Blocks without a header must be fully erased before they are used
+  bool spare = false;
+  for (uint16_t block=0; block<_blocks; ++block) {
+    if (blockSequence(block)==SPARE) {
+      if (!isErased(block)) {
+        eraseBlock(block); // Interrupted erase or header write
+      }
+      spare = true;
+    }
+  }
+  // New flash has no active block. It reads as zero, so NonVolatileStore::begin() calls
+  // resetStore(), which starts one.
+  if (_active!=_blocks && !spare) {
+    // Power failed while a block was being reclaimed. Finish the job.
+    uint16_t oldest = _blocks;
+    uint32_t oldestSequence = SPARE;
+    for (uint16_t block=0; block<_blocks; ++block) {
+      const uint32_t sequence = blockSequence(block);
+      if (block!=_active && sequence<oldestSequence) {
+        oldest = block;
+        oldestSequence = sequence;
+      }
+    }
+    collect(oldest);
+  }
+  return NonVolatileStore::begin();
+}
+
+void FlashLogStore::resetStore() {
+  for (uint16_t block=0; block<_blocks; ++block) {
+    if (!isErased(block)) {
+      eraseBlock(block);
+    }
+  }
+  memset(_map, 0, _chunks * sizeof(_map[0]));
+  _sequence = 0;
+  start(0);
+  const uint32_t magic = htonl(MAGIC_NUMBER);
+  writeImpl(0, &magic, sizeof(magic));
+}
+
+bool FlashLogStore::reclaim() {
+  if (_next * 4<_slotsPerBlock * 3) {
+    return false;
+  }
+  const uint32_t erases = _erases;
+  advance();
+  return _erases!=erases;
+}
+
+void FlashLogStore::readImpl(ps_offset_t offset, void *addr, uint16_t size) const {
+  uint8_t *bytes = (uint8_t *)addr;
+  while (size>0) {
+    const uint16_t chunk = offset / _chunkSize;
+    const uint16_t within = offset % _chunkSize;
+    const uint16_t n = MIN(size, (uint16_t)(_chunkSize - within));
+    if (_map[chunk]==0) {
+      memset(bytes, 0, n);
+    }
+    else {
+      _flash.read(slotAddress(_map[chunk] - 1) + sizeof(uint16_t) + within, bytes, n);
+    }
+    bytes += n;
+    offset += n;
+    size -= n;
+  }
+}
+
+void FlashLogStore::writeImpl(ps_offset_t offset, const void *bytes, uint16_t size) {
+  const StoreSpan span = { (void *)bytes, size };
+  writevImpl(offset, &span, 1);
+}
+
+// One record per chunk touched, however many spans fall in it
+void FlashLogStore::writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+  uint8_t data[PS_FLASH_MAX_CHUNK];
+  const ps_offset_t end = offset + spanBytes(spans, count);
+  uint8_t span = 0;
+  uint16_t used = 0; // Bytes of spans[span] already written
+  while (offset<end) {
+    const uint16_t chunk = offset / _chunkSize;
+    const ps_offset_t chunkStart = (ps_offset_t)chunk * _chunkSize;
+    readImpl(chunkStart, data, _chunkSize);
+    while (offset<end && offset<(chunkStart + _chunkSize)) {
+      while (used==spans[span].size) {
+        ++span;
+        used = 0;
+      }
+      const uint16_t n = MIN((uint16_t)(spans[span].size - used), (uint16_t)(chunkStart + _chunkSize - offset));
+      memcpy(data + (offset - chunkStart), (const uint8_t *)spans[span].addr + used, n);
+      used += n;
+      offset += n;
+    }
+    appendRecord(chunk, data);
+  }
+}
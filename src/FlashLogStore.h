@@ -0,0 +1,84 @@
+#ifndef FLASHLOGSTORE_H
+#define FLASHLOGSTORE_H
+
+#include "FlashDevice.h"
+
+#if !defined(PS_FLASH_MAX_CHUNK)
+  #define PS_FLASH_MAX_CHUNK 64 // Largest ChunkSize, which sets the record buffer on the stack
+#endif
+
+/*
+ * NonVolatileStore on raw flash, so that ParameterStore can use it without erasing a block
+ * on every set(). The store is split into chunks. A write appends a record with the new
+ * contents of each chunk it touches to the active erase block, and a RAM map points each
+ * chunk at its latest record. When the active block fills, writing moves on to the spare
+ * block and the oldest block is reclaimed: its live records are copied forward and it is
+ * erased to become the next spare. Blocks are used in turn, so erases are spread evenly.
+ * A record cut short by power failure fails its CRC and is ignored, leaving the writes
+ * before it, which is what ParameterStore's recovery expects.
+ *
+ * Each erase block starts with
+ *  4  SEQUENCE    Higher is newer. A block without one is the spare.
+ *  4  ~SEQUENCE
+ * then records, each padded to the write granularity
+ *  2  CHUNK
+ *  C  DATA
+ *  4  CRC         CRC-32 of CHUNK and DATA
+ * Chunks never written read as zero. The device needs at least two blocks, and all but one
+ * block must hold more records than there are chunks.
+ */
+class FlashLogStore : public NonVolatileStore {
+  FlashDevice &_flash;
+  const uint16_t _chunkSize;
+  const uint16_t _chunks;
+  uint16_t *_map; // Slot of each chunk's latest record plus one, 0 when never written
+  uint32_t _blockSize;
+  uint16_t _blocks;
+  uint16_t _headerBytes;
+  uint16_t _recordBytes;
+  uint16_t _slotsPerBlock;
+  uint16_t _active; // Block taking new records
+  uint16_t _next; // Next free slot in the active block
+  uint32_t _sequence; // Active block's
+  uint32_t _erases;
+
+  uint32_t slotAddress(const uint16_t slot) const;
+  uint32_t blockSequence(const uint16_t block) const;
+  bool isErased(const uint16_t block) const;
+  uint16_t readRecord(const uint16_t slot, uint8_t *data) const;
+  uint16_t replay(const uint16_t block);
+  void start(const uint16_t block);
+  bool advance();
+  bool collect(const uint16_t block);
+  bool appendRecord(const uint16_t chunk, const uint8_t *data);
+  void eraseBlock(const uint16_t block);
+
+public:
+  virtual bool begin();
+  // Erase the flash. The store reads as zero apart from its magic number.
+  virtual void resetStore();
+  // Move on from the active block now if it is over three quarters full, so that a later
+  // write doesn't wait for an erase. Call it when idle. Returns true if it erased a block.
+  bool reclaim();
+  uint32_t erases() const { return _erases; }
+
+protected:
+  FlashLogStore(FlashDevice &flash, const ps_offset_t size, const uint16_t chunkSize, uint16_t *map);
+  virtual void readImpl(ps_offset_t offset, void *addr, uint16_t size) const;
+  virtual void writeImpl(ps_offset_t offset, const void *bytes, uint16_t size);
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count);
+};
+
+// Size is the whole store, including the 4 byte magic number. The map takes 2 bytes of RAM
+// per ChunkSize bytes. Smaller chunks make smaller records, so blocks fill more slowly.
+template <ps_offset_t Size, uint16_t ChunkSize = 16>
+class FixedFlashLogStore : public FlashLogStore {
+  static_assert(ChunkSize>0 && ChunkSize<=PS_FLASH_MAX_CHUNK, "ChunkSize must be 1 to PS_FLASH_MAX_CHUNK");
+  uint16_t _storage[(Size + ChunkSize - 1) / ChunkSize];
+public:
+  FixedFlashLogStore(FlashDevice &flash)
+    : FlashLogStore(flash, Size, ChunkSize, _storage) {
+  }
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef FREESPACEMAP_H
+#define FREESPACEMAP_H
+
+#include "NonVolatileStore.h"
+
+/*
+ * RAM map of free extents in a ParameterStore, kept sorted by size so that
+ * best-fit allocation is a binary search instead of a walk of the store.
+ * Extent storage is supplied by FixedFreeSpaceMap.
+ * add() and remove() shift the array, which is O(n) in the extents held. The map is a
+ * few dozen extents in one block of RAM, so the shift is a short memmove, cheaper than a
+ * single store write and without the per-extent links a bucketed free list would need.
+ * A second copy sorted by offset finds the extent before a freed entry by binary search.
+ * If more extents exist than fit, the map marks itself invalid and
+ * ParameterStore falls back to walking the store until the next rebuild.
+ */
+class FreeSpaceMap {
+public:
+  struct Extent {
+    ps_offset_t offset;
+    uint16_t size;
+  };
+private:
+  Extent *_extents; // By size, then offset
+  Extent *_byOffset;
+  const uint16_t _capacity;
+  uint16_t _count;
+  bool _valid;
+
+  static bool before(const Extent &a, const uint16_t size, const ps_offset_t offset) {
+    return a.size<size || (a.size==size && a.offset<offset);
+  }
+  // First position whose extent is not before (size, offset)
+  uint16_t lowerBound(const uint16_t size, const ps_offset_t offset) const {
+    uint16_t lo = 0, hi = _count;
+    while (lo<hi) {
+      const uint16_t mid = (lo + hi) / 2;
+      if (before(_extents[mid], size, offset)) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+  // First position in _byOffset whose extent starts at or after offset
+  uint16_t offsetBound(const ps_offset_t offset) const {
+    uint16_t lo = 0, hi = _count;
+    while (lo<hi) {
+      const uint16_t mid = (lo + hi) / 2;
+      if (_byOffset[mid].offset<offset) {
+        lo = mid + 1;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+protected:
+  FreeSpaceMap(Extent *extents, Extent *byOffset, const uint16_t capacity)
+    : _extents(extents), _byOffset(byOffset), _capacity(capacity), _count(0), _valid(false) {
+  }
+
+public:
+  void clear() {
+    _count = 0;
+    _valid = true;
+  }
+  void invalidate() {
+    _valid = false;
+  }
+  bool isValid() const { return _valid; }
+  uint16_t count() const { return _count; }
+  const Extent &extent(const uint16_t i) const { return _extents[i]; }
+
+  bool add(const ps_offset_t offset, const uint16_t size) {
+    if (!_valid || _count>=_capacity) {
+      _valid = false;
+      return false;
+    }
+    const uint16_t pos = lowerBound(size, offset);
+    memmove(&_extents[pos + 1], &_extents[pos], (_count - pos) * sizeof(Extent));
+    _extents[pos].offset = offset;
+    _extents[pos].size = size;
+    const uint16_t at = offsetBound(offset);
+    memmove(&_byOffset[at + 1], &_byOffset[at], (_count - at) * sizeof(Extent));
+    _byOffset[at] = _extents[pos];
+    ++_count;
+    return true;
+  }
+
+  bool remove(const ps_offset_t offset, const uint16_t size) {
+    const uint16_t pos = lowerBound(size, offset);
+    if (pos>=_count || _extents[pos].offset!=offset || _extents[pos].size!=size) {
+      return false;
+    }
+    const uint16_t at = offsetBound(offset);
+    --_count;
+    memmove(&_extents[pos], &_extents[pos + 1], (_count - pos) * sizeof(Extent));
+    memmove(&_byOffset[at], &_byOffset[at + 1], (_count - at) * sizeof(Extent));
+    return true;
+  }
+
+  // Extent that ends where offset starts. Returns false when there is none.
+  bool findEndingAt(const ps_offset_t offset, ps_offset_t *start, uint16_t *size) const {
+    const uint16_t at = offsetBound(offset);
+    if (at==0 || (ps_offset_t)(_byOffset[at - 1].offset + _byOffset[at - 1].size)!=offset) {
+      return false;
+    }
+    *start = _byOffset[at - 1].offset;
+    *size = _byOffset[at - 1].size;
+    return true;
+  }
+
+  // Largest extent. Returns false when there is none.
+  bool largest(ps_offset_t *offset, uint16_t *size) const {
+    if (_count==0) {
+      return false;
+    }
+    *offset = _extents[_count - 1].offset;
+    *size = _extents[_count - 1].size;
+    return true;
+  }
+
+  // Smallest extent of at least neededSize. Returns false when none fits.
+  bool bestFit(const uint16_t neededSize, ps_offset_t *offset, uint16_t *size) const {
+    const uint16_t pos = lowerBound(neededSize, 0);
+    if (pos>=_count) {
+      return false;
+    }
+    *offset = _extents[pos].offset;
+    *size = _extents[pos].size;
+    return true;
+  }
+
+  // Lowest extent of at least neededSize starting at or after head, or failing that the
+  // lowest one before it. Returns false when none fits.
+  bool nextFit(const uint16_t neededSize, const ps_offset_t head, ps_offset_t *offset, uint16_t *size) const {
+    const Extent *next = NULL;
+    const Extent *first = NULL;
+    for (uint16_t i = lowerBound(neededSize, 0); i<_count; ++i) {
+      const Extent &extent = _extents[i];
+      if (extent.offset>=head && (!next || extent.offset<next->offset)) {
+        next = &extent;
+      }
+      if (!first || extent.offset<first->offset) {
+        first = &extent;
+      }
+    }
+    const Extent *fit = next ? next : first;
+    if (!fit) {
+      return false;
+    }
+    *offset = fit->offset;
+    *size = fit->size;
+    return true;
+  }
+};
+
+template <uint16_t Capacity>
+class FixedFreeSpaceMap : public FreeSpaceMap {
+  Extent _storage[Capacity];
+  Extent _offsetStorage[Capacity];
+public:
+  FixedFreeSpaceMap()
+    : FreeSpaceMap(_storage, _offsetStorage, Capacity) {
+  }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef KEYINDEX_H
+#define KEYINDEX_H
+
+#include "NonVolatileStore.h"
+
+// FNV-1a over at most maxLength characters of key (stops at '\0').
+// constexpr so that keys known at compile time can be hashed there.
+constexpr uint32_t hashKey(const char *key, const size_t maxLength, const uint32_t hash = 2166136261UL) {
+  return (maxLength==0 || *key=='\0') ? hash
+    : hashKey(key + 1, maxLength - 1, (uint32_t)((hash ^ (uint8_t)*key) * 16777619UL));
+}
+
+/*
+ * RAM index from key hash to entry offset, used by ParameterStore to avoid walking
+ * the entry chain on every lookup. Open addressing with linear probing; slot storage
+ * is supplied by FixedKeyIndex so that RAM cost is fixed at compile time.
+ * Offset 0 (the store header) marks an empty slot.
+ * If more keys are inserted than fit, the index marks itself invalid and
+ * ParameterStore falls back to walking the store until the next rebuild.
+ */
+class KeyIndex {
+public:
+  struct Slot {
+    uint16_t hash;
+    ps_offset_t offset;
+  };
+private:
+  Slot *_slots;
+  const uint16_t _capacity;
+  uint16_t _count;
+  bool _valid;
+
+  static uint16_t fold(const uint32_t hash) {
+    return (uint16_t)(hash ^ (hash >> 16));
+  }
+  uint16_t home(const uint16_t h) const {
+    return h % _capacity;
+  }
+  uint16_t nextSlot(const uint16_t s) const {
+    return (s + 1)==_capacity ? 0 : s + 1;
+  }
+  int findSlot(const uint16_t h, const ps_offset_t offset) const {
+    for (uint16_t s = home(h); _slots[s].offset!=0; s = nextSlot(s)) {
+      if (_slots[s].hash==h && _slots[s].offset==offset) {
+        return s;
+      }
+    }
+    return -1;
+  }
+
+protected:
+  KeyIndex(Slot *slots, const uint16_t capacity)
+    : _slots(slots), _capacity(capacity), _count(0), _valid(false) {
+  }
+
+public:
+  void clear() {
+    memset(_slots, 0, _capacity * sizeof(Slot));
+    _count = 0;
+    _valid = true;
+  }
+  void invalidate() {
+    _valid = false;
+  }
+  bool isValid() const { return _valid; }
+  uint16_t count() const { return _count; }
+  uint16_t capacity() const { return _capacity; }
+
+  bool insert(const uint32_t hash, const ps_offset_t offset) {
+    // Keep one slot empty so that probes always terminate.
+    if (!_valid || (_count + 1)>=_capacity) {
+      _valid = false;
+      return false;
+    }
+    const uint16_t h = fold(hash);
+    uint16_t s = home(h);
+    while (_slots[s].offset!=0) {
+      s = nextSlot(s);
+    }
+    _slots[s].hash = h;
+    _slots[s].offset = offset;
+    ++_count;
+    return true;
+  }
+
+  bool replace(const uint32_t hash, const ps_offset_t oldOffset, const ps_offset_t newOffset) {
+    const int s = findSlot(fold(hash), oldOffset);
+    if (s<0) {
+      return insert(hash, newOffset);
+    }
+    _slots[s].offset = newOffset;
+    return true;
+  }
+
+  bool remove(const uint32_t hash, const ps_offset_t offset) {
+    int found = findSlot(fold(hash), offset);
+    if (found<0) {
+      return false;
+    }
+    // Backward shift deletion: pull later members of the probe run into the hole.
+    uint16_t hole = found;
+    for (uint16_t s = nextSlot(hole); _slots[s].offset!=0; s = nextSlot(s)) {
+      const uint16_t want = home(_slots[s].hash);
+      // Move s into hole unless its home lies cyclically in (hole, s]
+      const bool stays = (hole<s) ? (hole<want && want<=s) : (hole<want || want<=s);
+      if (!stays) {
+        _slots[hole] = _slots[s];
+        hole = s;
+      }
+    }
+    _slots[hole].offset = 0;
+    --_count;
+    return true;
+  }
+
+  // Iterate candidate offsets for hash. Initialize *pos with start(hash).
+  // Returns 0 when no more candidates.
+  uint16_t start(const uint32_t hash) const {
+    return home(fold(hash));
+  }
+  ps_offset_t probe(const uint32_t hash, uint16_t *pos) const {
+    const uint16_t h = fold(hash);
+    while (_slots[*pos].offset!=0) {
+      const Slot &slot = _slots[*pos];
+      *pos = nextSlot(*pos);
+      if (slot.hash==h) {
+        return slot.offset;
+      }
+    }
+    return 0;
+  }
+};
+
+template <uint16_t Capacity>
+class FixedKeyIndex : public KeyIndex {
+  Slot _storage[Capacity];
+public:
+  FixedKeyIndex()
+    : KeyIndex(_storage, Capacity) {
+  }
+};
+
+#endif
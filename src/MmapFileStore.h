@@ -0,0 +1,139 @@
+// Store in a memory-mapped file, for Linux and other POSIX hosts.
+// The file has the same layout as a device's store, so it can be copied to or from one.
+
+#if !defined(_PS_MMAP_FILE_STORE_H_)
+#define _PS_MMAP_FILE_STORE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "NonVolatileStore.h"
+
+// When written bytes are flushed to the file with msync()
+enum MmapSync {
+  MmapSyncEachWrite, // Every write, so the store survives power loss like FRAM does
+  // When each set(), commit(), or compaction step completes. Between syncs the kernel may
+  // write pages back in any order, so the journal's write order isn't kept across a host
+  // power loss, only across the process exiting.
+  MmapSyncEachOperation,
+  MmapSyncDeferred, // Only on flush() and close(). Survives the process exiting, not the host.
+};
+
+class MmapFileStore : public NonVolatileStore {
+  const char *_path;
+  const MmapSync _mode;
+  int _fd;
+  uint8_t *_map;
+  ps_offset_t _dirtyStart; // Written bytes not yet flushed, empty when start>=end
+  ps_offset_t _dirtyEnd;
+
+  void msyncRange(const ps_offset_t start, const ps_offset_t end) {
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    const uintptr_t from = start / page * page;
+    msync(_map + from, end - from, MS_SYNC);
+  }
+  void written(const ps_offset_t offset, const uint16_t size) {
+    if (_mode==MmapSyncEachWrite) {
+      msyncRange(offset, offset + size);
+      return;
+    }
+    _dirtyStart = MIN(_dirtyStart, offset);
+    _dirtyEnd = MAX(_dirtyEnd, (ps_offset_t)(offset + size));
+  }
+
+public:
+  // size is the whole file, including the 4 byte magic number. A shorter file is extended.
+  MmapFileStore(const char *path, ps_offset_t size, MmapSync mode = MmapSyncEachOperation)
+    : NonVolatileStore(size), _path(path), _mode(mode), _fd(-1), _map(NULL),
+      _dirtyStart(size), _dirtyEnd(0) {
+  }
+  virtual ~MmapFileStore() {
+    close();
+  }
+
+  virtual bool begin() {
+    close();
+    const ps_offset_t bytes = size() + sizeof(uint32_t);
+    _fd = open(_path, O_RDWR | O_CREAT, 0644);
+    if (_fd<0) {
+      PS_LOG_ERROR(F("Could not open store file %s" CR), _path);
+      return false;
+    }
+    struct stat st;
+    if (fstat(_fd, &st)!=0 || (st.st_size<(off_t)bytes && ftruncate(_fd, bytes)!=0)) {
+      PS_LOG_ERROR(F("Could not size store file %s" CR), _path);
+      close();
+      return false;
+    }
+    void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map==MAP_FAILED) {
+      PS_LOG_ERROR(F("Could not map store file %s" CR), _path);
+      close();
+      return false;
+    }
+    _map = (uint8_t *)map;
+    return NonVolatileStore::begin();
+  }
+
+  // Write any unflushed bytes to the file
+  void flush() {
+    if (_map && _dirtyStart<_dirtyEnd) {
+      msyncRange(_dirtyStart, _dirtyEnd);
+    }
+    _dirtyStart = size() + sizeof(uint32_t);
+    _dirtyEnd = 0;
+  }
+
+  // Flush and unmap. begin() opens the file again.
+  void close() {
+    flush();
+    if (_map) {
+      munmap(_map, size() + sizeof(uint32_t));
+      _map = NULL;
+    }
+    if (_fd>=0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+  }
+
+  virtual void sync() {
+    if (_mode==MmapSyncEachOperation) {
+      flush();
+    }
+  }
+
+protected:
+  // Without a map, after a failed begin(), reads return zeros and writes are dropped
+  virtual void readImpl(ps_offset_t offset, void *addr, uint16_t size) const {
+    if (!_map) {
+      memset(addr, 0, size);
+      return;
+    }
+    memcpy(addr, _map + offset, size);
+  }
+  virtual void writeImpl(ps_offset_t offset, const void *bytes, uint16_t size) {
+    if (!_map) {
+      return;
+    }
+    memcpy(_map + offset, bytes, size);
+    written(offset, size);
+  }
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+    if (!_map) {
+      return;
+    }
+    const ps_offset_t start = offset;
+    for (uint8_t i=0; i<count; ++i) {
+      memcpy(_map + offset, spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+    written(start, offset - start); // One msync for the whole entry
+  }
+  virtual const uint8_t *addressImpl(ps_offset_t offset) const {
+    return _map ? _map + offset : NULL;
+  }
+};
+
+#endif
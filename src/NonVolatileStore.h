@@ -6,8 +6,21 @@
 #if !defined(MIN)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
+#if !defined(MAX)
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#endif
 
-#if !(defined(__IEEE_LITTLE_ENDIAN) || defined(__IEEE_BYTES_LITTLE_ENDIAN))
+// Store offsets are 16 bit unless PS_32BIT_OFFSETS is defined, for stores over 64KB.
+#if defined(PS_32BIT_OFFSETS)
+typedef uint32_t ps_offset_t;
+#else
+typedef uint16_t ps_offset_t;
+#endif
+
+// Stored numbers are big endian. Native little endian hosts swap as well, so that their
+// store files have the same layout as devices'.
+#if !(defined(__IEEE_LITTLE_ENDIAN) || defined(__IEEE_BYTES_LITTLE_ENDIAN) || \
+      (defined(PLATFORM_NATIVE) && defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__))
 #if !defined(htons)
 #define htons(x) (x)
 #endif
@@ -39,10 +52,59 @@
 #endif
 #endif
 
+#if defined(PS_32BIT_OFFSETS)
+#define htonoff(x) htonl(x)
+#define ntohoff(x) ntohl(x)
+#else
+#define htonoff(x) htons(x)
+#define ntohoff(x) ntohs(x)
+#endif
+
+// Define PS_STATS to count store and parameter operations. Otherwise counting compiles away.
+#if defined(PS_STATS)
+  #define PS_STAT(x) x
+#else
+  #define PS_STAT(x)
+#endif
+
+template <uint16_t PageSize, uint8_t Pages> class CachedStore;
+
+// One piece of a vectored read or write. Pieces are laid out back to back in the store.
+struct StoreSpan {
+  void *addr;
+  uint16_t size;
+};
+
+#if defined(PS_STATS)
+// Calls and bytes through the public read/write methods. Vectored calls count once.
+struct StoreStats {
+  uint32_t reads;
+  uint32_t readBytes;
+  uint32_t writes;
+  uint32_t writeBytes;
+};
+#endif
+
 class NonVolatileStore {
-  const uint16_t _size; // Allocated size (usable space = allocated - sizeof(magic value))
-  const uint16_t dataOffset;
+  template <uint16_t PageSize, uint8_t Pages> friend class CachedStore; // Reads and writes the store it wraps
+  const ps_offset_t _size; // Allocated size (usable space = allocated - sizeof(magic value))
+  const ps_offset_t dataOffset;
+#if defined(PS_STATS)
+  mutable StoreStats _stats;
+#endif
+  void countRead(const uint16_t size) const {
+    PS_STAT(++_stats.reads; _stats.readBytes += size);
+  }
+  void countWrite(const uint16_t size) {
+    PS_STAT(++_stats.writes; _stats.writeBytes += size);
+  }
 public:
+#if defined(PS_STATS)
+  const StoreStats &stats() const { return _stats; }
+  void resetStats() {
+    memset(&_stats, 0, sizeof(_stats));
+  }
+#endif
   virtual bool begin() {
     if (!isMagicSet()) {
       PS_LOG_INFO(F("Did not find magic number! Clearing storage." CR));
@@ -51,9 +113,10 @@ public:
     return true;
   }
 protected:
-  NonVolatileStore(uint16_t allocatedSize)
+  NonVolatileStore(ps_offset_t allocatedSize)
     : _size(allocatedSize),
       dataOffset(sizeof(uint32_t)) {
+    PS_STAT(resetStats());
   }
   bool isMagicSet() {
     #define MAGIC_NUMBER 0xFADE0042
@@ -64,53 +127,105 @@ protected:
     // PS_LOG_DEBUG(F("Read magic number %x" CR), magic_value);
     return (magic_value==MAGIC_NUMBER);
   }
-  virtual void readImpl(uint16_t offset, void *addr, uint16_t size) const =  0;
-  virtual void writeImpl(uint16_t offset, const void *bytes, uint16_t size) = 0;
+  virtual void readImpl(ps_offset_t offset, void *addr, uint16_t size) const =  0;
+  virtual void writeImpl(ps_offset_t offset, const void *bytes, uint16_t size) = 0;
+  // Backends that can do it in one bus transaction should override these.
+  virtual void readvImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) const {
+    for (uint8_t i=0; i<count; ++i) {
+      readImpl(offset, spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+  }
+  virtual void writevImpl(ps_offset_t offset, const StoreSpan *spans, uint8_t count) {
+    for (uint8_t i=0; i<count; ++i) {
+      writeImpl(offset, spans[i].addr, spans[i].size);
+      offset += spans[i].size;
+    }
+  }
+  // Backends whose bytes are directly addressable, e.g. RAM or memory-mapped flash,
+  // should override this to return a pointer to offset.
+  virtual const uint8_t *addressImpl(ps_offset_t /*offset*/) const {
+    return NULL;
+  }
+  static uint16_t spanBytes(const StoreSpan *spans, const uint8_t count) {
+    uint16_t total = 0;
+    for (uint8_t i=0; i<count; ++i) {
+      total += spans[i].size;
+    }
+    return total;
+  }
 public:
-  uint16_t size() const { return _size - dataOffset; } // Returns usable size
-  uint8_t readbyte(const uint16_t offset) const {
+  ps_offset_t size() const { return _size - dataOffset; } // Returns usable size
+  uint8_t readbyte(const ps_offset_t offset) const {
     PS_ASSERT((dataOffset + offset)<this->_size);
     uint8_t byte;
+    countRead(sizeof(byte));
     readImpl(dataOffset + offset, &byte, sizeof(byte));
     return byte;
   }
-  uint32_t readu32(const uint16_t offset) const {
+  uint32_t readu32(const ps_offset_t offset) const {
     uint32_t value = 0;
     PS_ASSERT((dataOffset + offset + sizeof(value))<=this->_size);
+    countRead(sizeof(value));
     readImpl(dataOffset + offset, (uint8_t *)&value, sizeof(value));
     return ntohl(value);
   }
-  uint16_t readu16(const uint16_t offset) const {
+  uint16_t readu16(const ps_offset_t offset) const {
     uint16_t value = 0;
     PS_ASSERT((dataOffset + offset + sizeof(value))<=this->_size);
+    countRead(sizeof(value));
     readImpl(dataOffset + offset, (uint8_t *)&value, sizeof(value));
     return ntohs(value);
   }
-  void read(const uint16_t offset, void *addr, const uint16_t size) const {
+  void read(const ps_offset_t offset, void *addr, const uint16_t size) const {
     PS_ASSERT((dataOffset + offset + size)<=this->_size);
+    countRead(size);
     readImpl(dataOffset + offset, addr, size);
   }
-  void writebyte(const uint16_t offset, const uint8_t byte) {
+  void readv(const ps_offset_t offset, const StoreSpan *spans, const uint8_t count) const {
+    PS_ASSERT((dataOffset + offset + spanBytes(spans, count))<=this->_size);
+    countRead(spanBytes(spans, count));
+    readvImpl(dataOffset + offset, spans, count);
+  }
+  // Pointer to the bytes at offset, or NULL if the backend isn't addressable.
+  const uint8_t *address(const ps_offset_t offset, const uint16_t size) const {
+    PS_ASSERT((dataOffset + offset + size)<=this->_size);
+    return addressImpl(dataOffset + offset);
+  }
+  void writebyte(const ps_offset_t offset, const uint8_t byte) {
+    countWrite(sizeof(byte));
     writeImpl(dataOffset + offset, &byte, sizeof(byte));
   }
-  void write(const uint16_t offset, const void *addr, const uint16_t size) {
+  void write(const ps_offset_t offset, const void *addr, const uint16_t size) {
     PS_ASSERT((dataOffset + offset + size)<=this->_size);
+    countWrite(size);
     writeImpl(dataOffset + offset, addr, size);
   }
-  void writeu16(const uint16_t offset, const uint16_t value) {
+  void writev(const ps_offset_t offset, const StoreSpan *spans, const uint8_t count) {
+    PS_ASSERT((dataOffset + offset + spanBytes(spans, count))<=this->_size);
+    countWrite(spanBytes(spans, count));
+    writevImpl(dataOffset + offset, spans, count);
+  }
+  void writeu16(const ps_offset_t offset, const uint16_t value) {
     PS_ASSERT((dataOffset + offset + sizeof(value))<=this->_size);
     uint16_t writable = htons(value);
+    countWrite(sizeof(value));
     writeImpl(dataOffset + offset, (uint8_t *)&writable, sizeof(value));
   }
-  void writeu32(const uint16_t offset, const uint32_t value) {
+  void writeu32(const ps_offset_t offset, const uint32_t value) {
     PS_ASSERT((dataOffset + offset + sizeof(value))<=this->_size);
     uint32_t writable = htonl(value);
+    countWrite(sizeof(value));
     writeImpl(dataOffset + offset, (uint8_t *)&writable, sizeof(value));
   }
+  // Called as each store operation completes. Backends that buffer writes should
+  // make them durable here. Others needn't override it.
+  virtual void sync() {
+  }
   virtual void resetStore() {
     uint8_t zeroes[100];
     memset(zeroes, 0, sizeof(zeroes));
-    for (uint16_t off = 0; off < this->_size; off += sizeof(zeroes)) {
+    for (ps_offset_t off = 0; off < this->_size; off += sizeof(zeroes)) {
       writeImpl(off, zeroes, MIN(sizeof(zeroes), (unsigned)(this->_size - off)));
     }
     uint32_t magic = htonl(MAGIC_NUMBER);
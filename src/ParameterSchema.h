@@ -0,0 +1,83 @@
+#ifndef PARAMETERSCHEMA_H
+#define PARAMETERSCHEMA_H
+
+#include "ParameterStore.h"
+
+// One key known at build time, with the size of its value.
+//   constexpr ParameterSlot Slots[] = { { PS_KEY("volume"), sizeof(uint8_t) }, ... };
+struct ParameterSlot {
+  ParameterKey key;
+  uint16_t size;
+};
+
+/*
+ * Gives each schema key a fixed slot at the start of the store, so that get() and set()
+ * go straight to it instead of walking the store. A slot is a pair of ordinary entries.
+ * set() writes the free one, journaled and CRC checked like any other set(), then frees
+ * the other. Slots are laid out when the store is created or cleared. A store without
+ * them keeps working, with schema keys in the entry chain like any other key.
+ * Keys are found through a hash table of slot numbers, built once when the schema is
+ * constructed, with twice as many buckets as slots so that probes stay short and always end.
+ */
+class ParameterSchema {
+public:
+  struct SlotState {
+    ps_offset_t offset; // First entry of the pair
+    bool elsewhere; // The key may also be in the entry chain, e.g. after a transaction
+  };
+private:
+  const ParameterSlot *_slots;
+  SlotState *_state;
+  const uint8_t _count;
+  uint8_t *_buckets; // Slot number, or _count when empty
+  const uint16_t _bucketCount;
+
+  uint16_t nextBucket(const uint16_t b) const {
+    return (b + 1)==_bucketCount ? 0 : b + 1;
+  }
+
+protected:
+  ParameterSchema(const ParameterSlot *slots, SlotState *state, const uint8_t count, uint8_t *buckets, const uint16_t bucketCount)
+    : _slots(slots), _state(state), _count(count), _buckets(buckets), _bucketCount(bucketCount) {
+  }
+  void buildBuckets() {
+    memset(_buckets, _count, _bucketCount);
+    for (uint8_t i=0; i<_count; ++i) {
+      uint16_t b = _slots[i].key.hash % _bucketCount;
+      while (_buckets[b]!=_count) {
+        b = nextBucket(b);
+      }
+      _buckets[b] = i;
+    }
+  }
+
+public:
+  uint8_t count() const { return _count; }
+  const ParameterSlot &slot(const uint8_t i) const { return _slots[i]; }
+  SlotState &state(const uint8_t i) { return _state[i]; }
+  const SlotState &state(const uint8_t i) const { return _state[i]; }
+
+  // Slot of key, or count() if key isn't in the schema
+  uint8_t find(const ParameterKey &key) const {
+    for (uint16_t b = key.hash % _bucketCount; _buckets[b]!=_count; b = nextBucket(b)) {
+      const ParameterKey &slotKey = _slots[_buckets[b]].key;
+      if (slotKey.hash==key.hash && strncmp(slotKey.name, key.name, PS_MAX_KEY_LENGTH)==0) {
+        return _buckets[b];
+      }
+    }
+    return _count;
+  }
+};
+
+template <uint8_t Slots>
+class FixedParameterSchema : public ParameterSchema {
+  SlotState _storage[Slots];
+  uint8_t _bucketStorage[2 * Slots];
+public:
+  FixedParameterSchema(const ParameterSlot (&slots)[Slots])
+    : ParameterSchema(slots, _storage, Slots, _bucketStorage, 2 * Slots) {
+    buildBuckets();
+  }
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include "ParameterStore.h"
+#include "Deserializer.h"
+#include "Snapshot.h"
+#include "ParameterSchema.h"
 
 /*
  * Format:
  * HEADER
  *  4  MAGIC           Everything else is valid
  *  2  FORMAT-VERSION  What is layout of store
- *  2  SIZE            Size of store
+ *  2  SIZE            Size of store (4 bytes with PS_32BIT_OFFSETS)
  *  8  PLAN            OFFSET/LENGTH/WRITE-CRC/PLAN-CRC where we plan to write.
  *                     If PLAN-CRC is correct, plan is valid.
  *                     If WRITE-CRC matches at location OFFSET+LENGTH,
@@ -14,32 +17,58 @@
  * ENTRIES
  *  2 SIZE             If free space, actual bytes to next entry.
  *                     If occupied, content size.
+ *                     Free runs longer than MAX_EXTENT are a chain of free entries.
  *  8 KEY              Free space is indicated with \0 first char of key.
  *                     Otherwise 'name' followed by 0 or more \0 to fill 8 bytes.
+ *                     With PS_HASHED_KEYS, 4 byte hash of the full name, 1 byte name length, 3 unused.
  *  N CONTENT
  *  P PADDING          Extra bytes such that (N+P) % UNIT == 0
- *  4 CRC
+ *  K NAME             PS_HASHED_KEYS only: full name, padded to UNIT
+ *  4 CRC              CRC-32 of header (with zero status), content, and any name.
+ *                     FORMAT 1 stores use calcCrc() instead.
+ * With a ParameterSchema, the first entries are two per schema key, each the size of the
+ * key's slot. One is live once the key is set and the other is left FlagFreed.
  */
 
-const uint16_t FORMAT = 1;
+#if defined(PS_32BIT_OFFSETS) && defined(PS_HASHED_KEYS)
+const uint16_t FORMAT = 5; // 5: 32 bit offsets and hashed keys
+#elif defined(PS_HASHED_KEYS)
+const uint16_t FORMAT = 4; // 4: CRC-32 with hashed keys
+#elif defined(PS_32BIT_OFFSETS)
+const uint16_t FORMAT = 3; // 3: CRC-32 with 32 bit offsets
+#else
+const uint16_t FORMAT = 2; // 2: CRC-32. 1: calcCrc(), still readable.
+#define FORMAT1_READABLE
+#endif
 const unsigned int UNIT = 4;
 const unsigned int KEYSIZE = 8;
 const unsigned int CRCSIZE = sizeof(uint32_t);
 const uint32_t CRCSEED = 0xA5A5;
+const uint16_t MAX_EXTENT = 0x10000 - UNIT; // Largest entry, since entry sizes are 16 bit
+
+const unsigned int SERIALIZE_CHUNK = 16; // Value bytes formatted per serialize() sink call
+const unsigned int SNAPSHOT_CHUNK = 32; // Value bytes per snapshot() sink call
+
+#define ELEMENTS(x) (sizeof(x) / sizeof((x)[0]))
 
 typedef enum FlagTag {
   FlagFree = 0,
   FlagSet = 1,
   FlagFreed = 2, // Interpret size like FlagSet, but entry is free
+  FlagMerge = 3, // Plan only: rewrite OFFSET as a free entry of SIZE total bytes
+  FlagTransaction = 4, // Plan only: SIZE bytes of entries at OFFSET are committed. RESTORE is the first entry's header.
+  FlagLoad = 5, // Plan only: like FlagTransaction, but the entries at OFFSET replace everything else
+  FlagUpdate = 6, // Plan only: value of the entry at OFFSET is overwritten in place. RESTORE is the old value of up to 4 bytes, or the offset of a copy.
 } FlagType;
 
 // Round up to unit size
-static uint16_t unitSize(const uint16_t size) {
+static ps_offset_t unitSize(const ps_offset_t size) {
   const uint16_t mod = size % UNIT;
   return size + (mod==0 ? 0 : UNIT - mod);
 }
 
-uint32_t calcCrc(const uint32_t seed, const uint8_t *buffer, const uint16_t size) {
+// Checksum used by FORMAT 1 stores
+uint32_t calcCrc(uint32_t seed, const uint8_t *buffer, uint16_t size) {
   // Simple crc
   uint32_t crc = seed;
   for (int i=0; i<size; ++i) {
@@ -69,25 +98,10 @@ size_t formatHexBytes(char *buffer, uint8_t *bytes, size_t count) {
   return 2 * count;
 }
 
-uint8_t nibble(const char h) {
-  if ('0' <= h && h <= '9') {
-    return h - '0';
-  }
-  else if ('A' <= h && h <= 'F') {
-    return h - 'A' + 10;
-  }
-  else if ('a' <= h && h <= 'f') {
-    return h - 'a' + 10;
-  }
-  else {
-    return 0;
-  }
-}
-
 struct __attribute__ ((packed)) PlanTag {
   uint8_t flag;
   uint8_t unused;
-  uint16_t offset;
+  ps_offset_t offset;
   uint16_t size;
   uint32_t entry_crc;
   struct {
@@ -99,33 +113,39 @@ struct __attribute__ ((packed)) PlanTag {
   } restore;
   uint32_t plan_crc;
 
-  uint16_t getOffset() const { return ntohs(offset); }
+  ps_offset_t getOffset() const { return ntohoff(offset); }
   uint16_t getSize() const { return ntohs(size); }
   uint32_t getEntryCrc() const { return ntohl(entry_crc); }
-  void setOffset(uint16_t offset) { this->offset = htons(offset); }
+  void setOffset(ps_offset_t offset) { this->offset = htonoff(offset); }
   void setSize(uint16_t size) { this->size = htons(size); }
   void setEntryCrc(uint32_t crc) { this->entry_crc = htonl(crc); }
-  uint32_t calcCrc() const {
-    return ::calcCrc(CRCSEED, (uint8_t *)this, sizeof(PlanTag)-sizeof(plan_crc));
+  uint32_t calcCrc(const CrcFunction crc) const {
+    return crc(CRCSEED, (uint8_t *)this, sizeof(PlanTag)-sizeof(plan_crc));
   }
-  void setCrc() {
-    plan_crc = htonl(calcCrc());
+  void setCrc(const CrcFunction crc) {
+    plan_crc = htonl(calcCrc(crc));
   }
-  bool isCrcValid() const {
-    return ntohl(plan_crc)==calcCrc();
+  bool isCrcValid(const CrcFunction crc) const {
+    return ntohl(plan_crc)==calcCrc(crc);
   }
-  bool isEmpty() const {
-    return flag==FlagFree || !isCrcValid();
+  bool isEmpty(const CrcFunction crc) const {
+    return flag==FlagFree || !isCrcValid(crc);
+  }
+  // Restore the target as a free entry of bytes. A freed entry's length would depend on
+  // the name length in header bytes the restore doesn't cover.
+  void setRestoreFree(uint16_t bytes) {
+    restore._size = htons(bytes);
+    restore._status._transaction = htons(0);
   }
 };
-static_assert(18==sizeof(struct PlanTag), "Plan expected to be 18 bytes");
+static_assert((16 + sizeof(ps_offset_t))==sizeof(struct PlanTag), "Plan expected to be 18 bytes (20 with 32 bit offsets)");
 
-typedef struct HeaderTag {
+typedef struct __attribute__ ((packed)) HeaderTag {
   uint16_t format;
-  uint16_t size;
+  ps_offset_t size;
   struct PlanTag plan;
 } Header;
-static_assert(22==sizeof(struct HeaderTag), "Header expected to be 22 bytes");
+static_assert((2 + 2 * sizeof(ps_offset_t) + 16)==sizeof(struct HeaderTag), "Header expected to be 22 bytes (26 with 32 bit offsets)");
 
 typedef struct EntryTag {
   uint16_t _size;
@@ -133,23 +153,43 @@ typedef struct EntryTag {
     uint8_t _flag;
     uint16_t _transaction;
   } _status;
+#if defined(PS_HASHED_KEYS)
+  uint32_t _hash; // hashKey() of the full name
+  uint8_t _keyLength; // Name follows the padded value
+  uint8_t _unused[3];
+#else
   char _name[KEYSIZE];
+#endif
 
   EntryTag() {
     _size = htons(0);
     _status._flag = FlagFree;
-    memset(_name, 0, sizeof(_name));
+    clearKey();
   }
   EntryTag(uint16_t size) {
     _size = htons(size);
     _status._flag = FlagFree;
-    memset(_name, 0, sizeof(_name));
+    clearKey();
   }
-  EntryTag(uint16_t size, const char *key) {
+  EntryTag(uint16_t size, const ParameterKey &key) {
     _size = htons(size);
     _status._transaction = htons(0);
-    memset(_name, 0, sizeof(_name)); // Pads with 0's to width
-    strncpy(_name, key, sizeof(_name));
+    clearKey(); // Pads with 0's to width
+#if defined(PS_HASHED_KEYS)
+    _hash = htonl(key.hash);
+    _keyLength = key.length;
+#else
+    strncpy(_name, key.name, sizeof(_name));
+#endif
+  }
+  void clearKey() {
+#if defined(PS_HASHED_KEYS)
+    _hash = 0;
+    _keyLength = 0;
+    memset(_unused, 0, sizeof(_unused));
+#else
+    memset(_name, 0, sizeof(_name));
+#endif
   }
   uint16_t getSize() const {
     return ntohs(_size);
@@ -157,58 +197,235 @@ typedef struct EntryTag {
   bool isFree() const {
     return _status._flag==FlagFree || _status._flag==FlagFreed;
   }
+  uint16_t keyBytes() const {
+#if defined(PS_HASHED_KEYS)
+    return unitSize(_keyLength);
+#else
+    return 0; // Name is in the header
+#endif
+  }
+  // Bytes taken by an allocated or once allocated entry. 0, which no walk accepts, when the
+  // size is more than an entry can hold, rather than a wrapped length that looks valid.
+  uint16_t entryBytes() const {
+    const uint32_t bytes = (uint32_t)sizeof(EntryTag) + unitSize(getSize()) + keyBytes() + CRCSIZE;
+    return bytes>MAX_EXTENT ? 0 : (uint16_t)bytes;
+  }
   uint16_t totalBytes() const {
     if (_status._flag==FlagFree) {
       return getSize();
     }
     else {
-      // Allocated or once allocated.
-      return sizeof(EntryTag) + unitSize(getSize()) + CRCSIZE;
-    }
-  }
-  uint32_t calcCrc() const {
-    return ::calcCrc(CRCSEED, (uint8_t *)this, sizeof(EntryTag));
-  }
-  uint32_t calcCrc(const uint8_t *buffer, const uint16_t size) const {
-    uint32_t crc = calcCrc();
-    return ::calcCrc(crc, buffer, size);
-  }
-  static bool readAndCheckCrc(uint32_t matchCrc, NonVolatileStore &store, const uint16_t offset, const uint16_t size, char *key) {
-    uint8_t buffer[200];
-    uint16_t dataSize = sizeof(EntryTag) + unitSize(size);
-    PS_ASSERT(dataSize<=sizeof(buffer));
-    store.read(offset, buffer, dataSize);
-    EntryTag entry; // Used for sizing.
-    strncpy(key, (char *)(buffer + sizeof(entry._size) + sizeof(entry._status)), KEYSIZE);
-    uint32_t dataCrc = ::calcCrc(CRCSEED, buffer, sizeof(EntryTag) + size);
-    uint32_t readCrc = store.readu32(offset + dataSize);
+      return entryBytes();
+    }
+  }
+  // A small free entry at the end of the store may be shorter than the header
+  void readHeader(const NonVolatileStore &store, const ps_offset_t offset) {
+    store.read(offset, this, MIN(sizeof(*this), (unsigned)(store.size() - offset)));
+  }
+  // Read only the header fields that totalBytes() needs
+  void readSize(const NonVolatileStore &store, const ps_offset_t offset) {
+#if defined(PS_HASHED_KEYS)
+    // A small free entry at the end of the store may be shorter than that
+    const uint16_t bytes = (uint8_t *)&_keyLength - (uint8_t *)this + sizeof(_keyLength);
+    store.read(offset, this, MIN(bytes, store.size() - offset));
+#else
+    store.read(offset, this, sizeof(_size) + sizeof(_status));
+#endif
+  }
+  uint32_t keyHash() const {
+#if defined(PS_HASHED_KEYS)
+    return ntohl(_hash);
+#else
+    return hashKey(_name, KEYSIZE);
+#endif
+  }
+  // Copy the name into key, which holds PS_MAX_KEY_LENGTH+1 characters.
+  void readKey(const NonVolatileStore &store, const ps_offset_t offset, char *key) const {
+#if defined(PS_HASHED_KEYS)
+    const uint8_t length = MIN(_keyLength, PS_MAX_KEY_LENGTH);
+    store.read(offset + sizeof(EntryTag) + unitSize(getSize()), key, length);
+    key[length] = '\0';
+#else
+    strncpy(key, _name, KEYSIZE);
+    key[KEYSIZE] = '\0';
+#endif
+  }
+  bool hasKey(const NonVolatileStore &store, const ps_offset_t offset, const ParameterKey &key) const {
+#if defined(PS_HASHED_KEYS)
+    // Hash and length rule out nearly every entry without reading its name
+    if (ntohl(_hash)!=key.hash || _keyLength!=key.length) {
+      return false;
+    }
+    char name[PS_MAX_KEY_LENGTH + 1];
+    readKey(store, offset, name);
+    return 0==memcmp(name, key.name, key.length);
+#else
+    return 0==strncmp(_name, key.name, KEYSIZE);
+#endif
+  }
+  uint32_t calcCrc(const CrcFunction crc) const {
+    return crc(CRCSEED, (uint8_t *)this, sizeof(EntryTag));
+  }
+  uint32_t calcCrc(const CrcFunction crc, const uint8_t *buffer, const uint16_t size, const ParameterKey &key) const {
+#if defined(PS_HASHED_KEYS)
+    return crc(crc(calcCrc(crc), buffer, size), (const uint8_t *)key.name, key.length);
+#else
+    return crc(calcCrc(crc), buffer, size);
+#endif
+  }
+  // Check the stored CRC against a value that is already in memory
+  bool checkCrc(const CrcFunction crc, const NonVolatileStore &store, const ps_offset_t offset, const uint8_t *value, const ParameterKey &key) const {
+    EntryTag header = *this;
+    header._status._transaction = htons(0); // CRC is calculated before the flag is set
+    const uint16_t size = getSize();
+    return header.calcCrc(crc, value, size, key)==store.readu32(offset + sizeof(EntryTag) + unitSize(size) + keyBytes());
+  }
+  static bool readAndCheckCrc(const CrcFunction crc, uint32_t matchCrc, NonVolatileStore &store, const ps_offset_t offset, const uint16_t size, char *key) {
+    EntryTag entry;
+    uint8_t buffer[32];
+    // Header and first chunk of value in one transfer
+    uint16_t done = MIN(sizeof(buffer), size);
+    StoreSpan spans[] = {
+      { &entry, sizeof(entry) },
+      { buffer, done },
+    };
+    store.readv(offset, spans, ELEMENTS(spans));
+    if (entry._status._flag!=FlagSet || entry.getSize()!=size) {
+      return false; // Could be an earlier value freed at the same offset
+    }
+    const ps_offset_t keyOffset = offset + sizeof(EntryTag) + unitSize(size);
+    if (keyOffset + entry.keyBytes() + CRCSIZE>store.size()) {
+      return false;
+    }
+    entry.readKey(store, offset, key);
+    // CRC is calculated before the flag is set (see write())
+    entry._status._transaction = htons(0);
+    uint32_t dataCrc = crc(entry.calcCrc(crc), buffer, done);
+    while (done<size) {
+      const uint16_t chunk = MIN(sizeof(buffer), (unsigned)(size - done));
+      store.read(offset + sizeof(EntryTag) + done, buffer, chunk);
+      dataCrc = crc(dataCrc, buffer, chunk);
+      done += chunk;
+    }
+#if defined(PS_HASHED_KEYS)
+    if (entry._keyLength>PS_MAX_KEY_LENGTH) {
+      return false;
+    }
+    dataCrc = crc(dataCrc, (const uint8_t *)key, entry._keyLength);
+#endif
+    uint32_t readCrc = store.readu32(keyOffset + entry.keyBytes());
     return matchCrc==dataCrc && matchCrc==readCrc;
   }
-  static void writeFree(NonVolatileStore &store, const uint16_t offset, const uint16_t size) {
+  static void writeFree(NonVolatileStore &store, const ps_offset_t offset, const uint16_t size) {
     EntryTag entry(size);
     PS_ASSERT(entry._status._flag==FlagFree);
     // Write five bytes size+transaction plus initial name byte '\0' indicating free
     // PS_LOG_DEBUG(F("Writing free to %d with size %d" CR), offset, size);
     store.write(offset, &entry, sizeof(entry._size) + sizeof(entry._status));
   }
-  void write(NonVolatileStore &store, const uint16_t offset, const uint8_t *buffer, const uint32_t crc) {
+  // Header bytes before from are not written, e.g. to leave a free header in place.
+  void write(NonVolatileStore &store, const ps_offset_t offset, const uint8_t *buffer, const uint32_t crc, const ParameterKey &key, const uint16_t from = 0) {
     _status._flag = FlagSet;
-    store.write(offset, this, sizeof(*this));
-    store.write(offset + sizeof(*this), (void *)buffer, ntohs(_size));
-    store.writeu32(offset + sizeof(EntryTag) + unitSize(ntohs(_size)), crc);
+    static const uint8_t padding[UNIT - 1] = { 0 };
+    uint32_t storeCrc = htonl(crc);
+    const uint16_t size = ntohs(_size);
+    // Header, value, padding, any name, and CRC in one transfer
+    StoreSpan spans[] = {
+      { (uint8_t *)this + from, (uint16_t)(sizeof(*this) - from) },
+      { (void *)buffer, size },
+      { (void *)padding, (uint16_t)(unitSize(size) - size) },
+#if defined(PS_HASHED_KEYS)
+      { (void *)key.name, key.length },
+      { (void *)padding, (uint16_t)(unitSize(key.length) - key.length) },
+#endif
+      { &storeCrc, sizeof(storeCrc) },
+    };
+    store.writev(offset + from, spans, ELEMENTS(spans));
   }
 } Entry;
 
 static_assert (12==sizeof(Entry), "Entry expected to be 12 bytes");
 #define OFFSET(struc, field) (((uint8_t *)&struc.field) - ((uint8_t *)&struc))
 
-ParameterStore::ParameterStore(NonVolatileStore &store)
-  : _store(store), _size(unitSize(store.size()))
+// False for a zero or overlong entry, which only shows up in a corrupt store.
+static bool isValidExtent(const ps_offset_t offset, const uint16_t bytes, const ps_offset_t size) {
+  return bytes>0 && bytes<=(size - offset);
+}
+
+// Mark size bytes at offset free, as a chain of entries if it won't fit in one.
+static void writeFreeRun(NonVolatileStore &store, ps_offset_t offset, ps_offset_t size, FreeSpaceMap *freeMap) {
+  while (size>0) {
+    // Leave room for a whole entry after a full one
+    const uint16_t bytes = (size<=MAX_EXTENT) ? size : MIN(MAX_EXTENT, size - 2 * sizeof(Entry));
+    Entry::writeFree(store, offset, bytes);
+    if (freeMap) {
+      freeMap->add(offset, bytes);
+    }
+    offset += bytes;
+    size -= bytes;
+  }
+}
+
+static void writePlan(NonVolatileStore &store, const CrcFunction crc, PlanTag &plan) {
+  Header header; // Used for offsets
+  plan.setCrc(crc);
+  // Write all but initial flag.
+  store.write(OFFSET(header, plan.unused), &plan.unused, sizeof(plan) - 1);
+  // Once plan is written, add flag byte.
+  store.writebyte(OFFSET(header, plan), plan.flag);
+}
+
+static void copyBytes(NonVolatileStore &store, const ps_offset_t from, const ps_offset_t to, const uint16_t bytes) {
+  uint8_t buffer[32];
+  for (uint16_t done = 0; done<bytes; ) {
+    const uint16_t chunk = MIN(sizeof(buffer), (unsigned)(bytes - done));
+    store.read(from + done, buffer, chunk);
+    store.write(to + done, buffer, chunk);
+    done += chunk;
+  }
+}
+
+static bool sameBytes(const NonVolatileStore &store, const ps_offset_t offset, const uint8_t *buffer, const uint16_t bytes) {
+  uint8_t stored[32];
+  for (uint16_t done = 0; done<bytes; ) {
+    const uint16_t chunk = MIN(sizeof(stored), (unsigned)(bytes - done));
+    store.read(offset + done, stored, chunk);
+    if (memcmp(stored, buffer + done, chunk)!=0) {
+      return false;
+    }
+    done += chunk;
+  }
+  return true;
+}
+
+// Ends every planned operation, so the store is synced here.
+static void clearPlan(NonVolatileStore &store) {
+  Header header; // Used for offsets
+  store.writebyte(OFFSET(header, plan.flag), FlagFree);
+  store.sync();
+}
+
+ParameterStore::ParameterStore(NonVolatileStore &store, KeyIndex *index, FreeSpaceMap *freeMap, ParameterSchema *schema)
+  : _store(store), _size(unitSize(store.size())),
+    _end(sizeof(Header) + (store.size() - sizeof(Header)) / UNIT * UNIT), _index(index), _freeMap(freeMap), _compactCursor(sizeof(Header)),
+    _crc(psCrc32), _txOffset(0), _txSize(0), _txUsed(0), _loading(false), _schema(schema), _schemaEnd(sizeof(Header)),
+    _allocation(AllocateBestFit), _head(0)
 {
+  PS_STAT(resetStats());
 }
 
 bool ParameterStore::begin() {
   PS_ASSERT(sizeof(Header)<_size);
+  // Maps from an earlier begin() may be stale. Recovery walks the store.
+  if (_index) {
+    _index->invalidate();
+  }
+  if (_freeMap) {
+    _freeMap->invalidate();
+  }
+  _compactCursor = sizeof(Header);
+  _txOffset = 0; // An open transaction is abandoned
+  _head = 0; // Found by the first rotating set()
   bool ok = _store.begin();
   if (!ok) {
     PS_LOG_ERROR(F("Underlying store failed begin()" CR));
@@ -220,42 +437,238 @@ bool ParameterStore::begin() {
   if (format==0) {
     // Store was just reset...start from scratch
     PS_LOG_DEBUG(F("Initializing store with format %d and size %d" CR), FORMAT, _size);
-    _store.writeu16(OFFSET(header, size), _size);
-    Entry::writeFree(_store, sizeof(Header), _size - sizeof(Header));
+    const ps_offset_t size = htonoff(_size);
+    _store.write(OFFSET(header, size), &size, sizeof(size));
+    layOutSchema();
+    writeFreeRun(_store, _schemaEnd, _end - _schemaEnd, NULL);
     // Write format last...if it succeeds, we have valid header
     _store.writeu16(OFFSET(header, format), FORMAT);
+    _store.sync();
+    format = FORMAT;
   }
+#if defined(FORMAT1_READABLE)
+  else if (format!=FORMAT && format!=1) {
+#else
   else if (format!=FORMAT) {
+#endif
     PS_LOG_ERROR(F("Unrecognized store format: %d (0x%x)" CR), format, format);
     return false;
   }
   else {
-    uint16_t size = ntohs(header.size);
+    ps_offset_t size = ntohoff(header.size);
     if (size!=_size) {
       PS_LOG_ERROR(F("Unknown size requested %d vs store %d" CR), size, _size);
       return false;
     }
   }
-  return recoverPlan(header);
+  // Format 1 stores keep their checksum. deserialize() rewrites a store as the current format.
+  _crc = (format==1) ? calcCrc : psCrc32;
+  checkSchema(); // Recovery may need to know where the slots are
+  if (!recoverPlan(header)) {
+    return false;
+  }
+  scanSchema();
+  rebuildMaps();
+  return true;
+}
+
+static uint16_t slotBytes(const ParameterSlot &slot) {
+  return Entry(slot.size, slot.key).entryBytes();
+}
+
+// Write each schema slot as a pair of freed entries after the header
+void ParameterStore::layOutSchema() {
+  _schemaEnd = sizeof(Header);
+  if (!_schema) {
+    return;
+  }
+  ps_offset_t total = 0;
+  for (uint8_t i=0; i<_schema->count(); ++i) {
+    total += 2 * slotBytes(_schema->slot(i));
+  }
+  if (total>(_end - sizeof(Header))) {
+    PS_LOG_ERROR(F("Schema needs %d bytes, more than the store has" CR), total);
+    return;
+  }
+  ps_offset_t offset = sizeof(Header);
+  for (uint8_t i=0; i<_schema->count(); ++i) {
+    const ParameterSlot &slot = _schema->slot(i);
+    Entry entry(slot.size, slot.key);
+    entry._status._flag = FlagFreed;
+    _schema->state(i).offset = offset;
+    _schema->state(i).elsewhere = false;
+    for (uint8_t twin=0; twin<2; ++twin) {
+      _store.write(offset, &entry, sizeof(entry));
+      offset += entry.entryBytes();
+    }
+  }
+  _schemaEnd = offset;
+}
+
+// Find the slots laid out by layOutSchema(). A store without them, or with another
+// schema's, keeps every key in the entry chain.
+void ParameterStore::checkSchema() {
+  _schemaEnd = sizeof(Header);
+  if (!_schema) {
+    return;
+  }
+  ps_offset_t offset = sizeof(Header);
+  for (uint8_t i=0; i<_schema->count(); ++i) {
+    const ParameterSlot &slot = _schema->slot(i);
+    const uint16_t bytes = slotBytes(slot);
+    _schema->state(i).offset = offset;
+    for (uint8_t twin=0; twin<2; ++twin) {
+      Entry entry;
+      entry.readHeader(_store, offset);
+      if ((entry._status._flag!=FlagSet && entry._status._flag!=FlagFreed) || entry.getSize()!=slot.size
+          || entry.keyHash()!=slot.key.hash || entry.entryBytes()!=bytes || bytes>(_end - offset)) {
+        PS_LOG_INFO(F("Store has no slots for this schema. Its keys use the entry chain." CR));
+        return;
+      }
+      offset += bytes;
+    }
+  }
+  _schemaEnd = offset;
+}
+
+// Note which schema keys also have entries in the chain, e.g. from a transaction
+void ParameterStore::scanSchema() {
+  if (_schemaEnd==sizeof(Header)) {
+    return;
+  }
+  for (uint8_t i=0; i<_schema->count(); ++i) {
+    _schema->state(i).elsewhere = false;
+  }
+  Entry entry;
+  for (ps_offset_t offset = _schemaEnd; offset<_end; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
+    for (uint8_t i=0; !entry.isFree() && i<_schema->count(); ++i) {
+      if (entry.hasKey(_store, offset, _schema->slot(i).key)) {
+        _schema->state(i).elsewhere = true;
+      }
+    }
+  }
+}
+
+bool ParameterStore::findSlot(const ParameterKey &key, uint8_t *slot) const {
+  if (_schemaEnd==sizeof(Header)) {
+    return false;
+  }
+  *slot = _schema->find(key);
+  return *slot<_schema->count();
+}
+
+// Offset of the slot's live entry, or 0 if the key isn't set there
+ps_offset_t ParameterStore::liveSlot(const uint8_t slot) const {
+  const ps_offset_t first = _schema->state(slot).offset;
+  const ps_offset_t offsets[] = { first, (ps_offset_t)(first + slotBytes(_schema->slot(slot))) };
+  for (uint8_t twin=0; twin<2; ++twin) {
+    Entry entry;
+    entry.readSize(_store, offsets[twin]);
+    if (entry._status._flag==FlagSet) {
+      return offsets[twin];
+    }
+  }
+  return 0;
+}
+
+// set() for a key with a slot. Writes the freed twin, journaled as set() does, then frees
+// the live one, so recovery of an interrupted write works unchanged.
+int ParameterStore::setSlot(const uint8_t slot, const ParameterKey &key, const uint8_t *buffer, const uint16_t size) {
+  const ps_offset_t first = _schema->state(slot).offset;
+  const uint16_t bytes = slotBytes(_schema->slot(slot));
+  uint16_t priorBytes = bytes;
+  ps_offset_t prior = liveSlot(slot);
+  const ps_offset_t offset = (prior==first) ? first + bytes : first;
+  if (prior==0 && _schema->state(slot).elsewhere) {
+    prior = findKey(0, key, false, 0, &priorBytes);
+  }
+  const bool existing = (prior!=0 && prior<_size);
+
+  Entry entry(size, key);
+  const uint32_t crc = entry.calcCrc(_crc, buffer, size, key);
+  PlanTag plan;
+  plan.flag = FlagSet;
+  plan.unused = 0;
+  plan.setOffset(offset);
+  plan.setSize(size);
+  plan.setEntryCrc(crc);
+  _store.read(offset, &plan.restore, sizeof(plan.restore));
+  writePlan(_store, _crc, plan);
+
+  entry.write(_store, offset, buffer, crc, key);
+  if (existing) {
+    _store.writebyte(prior + OFFSET(entry, _status._flag), FlagFreed);
+  }
+  if (_index) {
+    if (existing) {
+      _index->replace(key.hash, prior, offset);
+    }
+    else {
+      _index->insert(key.hash, offset);
+    }
+  }
+  clearPlan(_store);
+
+  if (existing && prior>=_schemaEnd) {
+    uint16_t merged;
+    coalesce(prior, priorBytes, &merged);
+  }
+  _schema->state(slot).elsewhere = false;
+  return PS_SUCCESS;
+}
+
+void ParameterStore::rebuildMaps() {
+  if (!_index && !_freeMap) {
+    return;
+  }
+  if (_index) {
+    _index->clear();
+  }
+  if (_freeMap) {
+    _freeMap->clear();
+  }
+  Entry entry;
+  for (ps_offset_t offset = sizeof(Header); offset<_end; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
+    if (entry.isFree()) {
+      if (offset<_schemaEnd) {
+        continue; // Free twin of a slot, not space for other entries
+      }
+      if (_freeMap && _freeMap->isValid() && !_freeMap->add(offset, entry.totalBytes())) {
+        PS_LOG_INFO(F("Free space map full at %d extents. Falling back to store walk." CR), _freeMap->count());
+      }
+    }
+    else if (_index && _index->isValid() && !_index->insert(entry.keyHash(), offset)) {
+      PS_LOG_INFO(F("Key index full at %d entries. Falling back to store walk." CR), _index->count());
+    }
+  }
 }
 
 bool ParameterStore::recoverPlan(const Header &header) {
   // PS_LOG_DEBUG(F("Header plan flag %d" CR), header.plan.flag);
 
   // If plan invalid or marked used, ignore it.
-  if (header.plan.isEmpty()) {
+  if (header.plan.isEmpty(_crc)) {
     // PS_LOG_DEBUG(F("No recovery necessary" CR));
     return true;
   }
 
   // We need to do some work because the last operation was interrupted and left the plan in place
+  PS_STAT(++_stats.recoveries);
   if (header.plan.flag==FlagSet) {
     // PS_LOG_DEBUG(F("Recovering from interrupted set" CR));
     // We were trying to write. Make sure that the write was completed successfully.
-    char key[KEYSIZE];
-    if (Entry::readAndCheckCrc(header.plan.getEntryCrc(), _store, header.plan.getOffset(), header.plan.getSize(), key)) {
+    char key[PS_MAX_KEY_LENGTH + 1];
+    if (Entry::readAndCheckCrc(_crc, header.plan.getEntryCrc(), _store, header.plan.getOffset(), header.plan.getSize(), key)) {
       // If so, check whether there is another entry that should have been overwritten.
-      uint16_t found = findKey(0, key, false, 0);
+      ps_offset_t found = findKey(0, key, false, 0);
       if (found==header.plan.getOffset()) {
         // We found current, keep looking beyond found offset...
         found = findKey(found+1, key, false, 0);
@@ -271,7 +684,38 @@ bool ParameterStore::recoverPlan(const Header &header) {
       _store.write(header.plan.getOffset(), &header.plan.restore, sizeof(header.plan.restore));
     }
     // Then mark plan empty.
-    _store.writebyte(OFFSET(header, plan.flag), FlagFree);
+    clearPlan(_store);
+  }
+  else if (header.plan.flag==FlagUpdate) {
+    // Value was being overwritten in place. Unless the new one is whole, put the old one back.
+    char key[PS_MAX_KEY_LENGTH + 1];
+    if (!Entry::readAndCheckCrc(_crc, header.plan.getEntryCrc(), _store, header.plan.getOffset(), header.plan.getSize(), key)) {
+      restoreUpdate(header.plan);
+    }
+    clearPlan(_store);
+  }
+  else if (header.plan.flag==FlagMerge) {
+    // Merged extent was all free when the plan was written. Redo the header write.
+    Entry::writeFree(_store, header.plan.getOffset(), header.plan.getSize());
+    clearPlan(_store);
+  }
+  else if (header.plan.flag==FlagTransaction || header.plan.flag==FlagLoad) {
+    // Entries were all written before the commit record. Finish making them visible.
+    const ps_offset_t offset = header.plan.getOffset();
+    const uint16_t size = header.plan.getSize();
+    if (transactionCrc(offset, size, &header.plan.restore)==header.plan.getEntryCrc()) {
+      if (header.plan.flag==FlagLoad) {
+        applyLoad(header.plan);
+      }
+      else {
+        applyTransaction(header.plan);
+      }
+    }
+    else {
+      // Entries damaged since commit. Drop the whole transaction.
+      Entry::writeFree(_store, offset, size);
+    }
+    clearPlan(_store);
   }
   else {
     PS_LOG_ERROR(F("Recovery unimplemented" CR));
@@ -280,70 +724,197 @@ bool ParameterStore::recoverPlan(const Header &header) {
   return true;
 }
 
-uint16_t ParameterStore::findFreeSpace(uint16_t neededSize, uint16_t *foundSize /* Hack to return foundSize */) const {
-  uint16_t offset = sizeof(Header);
-  // Walk through entries looking for free one that is big enough...
-  while (offset<_size) {
+// Write back the value that update() saved
+void ParameterStore::restoreUpdate(const PlanTag &plan) {
+  const ps_offset_t offset = plan.getOffset();
+  const uint16_t size = plan.getSize();
+  Entry entry;
+  entry.readHeader(_store, offset);
+  if (size<=sizeof(plan.restore)) {
+    // The old CRC wasn't kept, so work it out again
+    char name[PS_MAX_KEY_LENGTH + 1];
+    entry.readKey(_store, offset, name);
+    const ParameterKey key(name);
+    Entry old(size, key);
+    const uint8_t *value = (const uint8_t *)&plan.restore;
+    old.write(_store, offset, value, old.calcCrc(_crc, value, size, key), key, sizeof(Entry));
+  }
+  else {
+    ps_offset_t backup;
+    memcpy(&backup, &plan.restore, sizeof(backup));
+    backup = ntohoff(backup) + sizeof(Entry);
+    copyBytes(_store, backup, offset + sizeof(Entry), size);
+    copyBytes(_store, backup + size, offset + entry.entryBytes() - CRCSIZE, CRCSIZE);
+  }
+}
+
+ps_offset_t ParameterStore::findFreeSpace(uint16_t neededSize, uint16_t *foundSize /* Hack to return foundSize */) const {
+  if (_freeMap && _freeMap->isValid()) {
+    ps_offset_t offset;
+    uint16_t size;
+    const bool found = (_allocation==AllocateRotating) ? _freeMap->nextFit(neededSize, _head, &offset, &size)
+                                                       : _freeMap->bestFit(neededSize, &offset, &size);
+    if (!found) {
+      return _size;
+    }
+    if (foundSize) {
+      *foundSize = size;
+    }
+    return offset;
+  }
+
+  ps_offset_t best = _size;
+  uint16_t bestSize = 0;
+  ps_offset_t offset = _schemaEnd;
+  // Walk through entries looking for the smallest free one that is big enough...
+  while (offset<_end) {
     Entry entry;
-    _store.read(offset, &entry, sizeof(entry._size) + sizeof(entry._status));
+    entry.readSize(_store, offset);
     uint16_t size = entry.totalBytes();
+    if (!isValidExtent(offset, size, _size)) {
+      break; // Corrupt store
+    }
 
-    if (entry.isFree() && neededSize<=size) {
-      // TODO: Maybe keep going to look for a smaller free entry that works...
-      if (foundSize) {
-        *foundSize = size;
+    if (entry.isFree() && neededSize<=size && _allocation==AllocateRotating) {
+      if (offset>=_head || best==_size) {
+        best = offset; // Wraps to the first fit if none follows the head
+        bestSize = size;
+      }
+      if (offset>=_head) {
+        break;
       }
-      break;
     }
-    else {
-      offset += entry.totalBytes();
+    else if (entry.isFree() && neededSize<=size && (best==_size || size<bestSize)) {
+      best = offset;
+      bestSize = size;
+      if (size==neededSize) {
+        break; // Can't do better than exact
+      }
     }
+    offset += size;
   }
-  // PS_LOG_DEBUG(F("Free space search for %d responds %d (of %d)" CR), neededSize, offset, _size);
-  return offset; // Will be == _size when not found
+  if (foundSize && best<_size) {
+    *foundSize = bestSize;
+  }
+  // PS_LOG_DEBUG(F("Free space search for %d responds %d (of %d)" CR), neededSize, best, _size);
+  return best; // Will be == _size when not found
 }
 
-uint16_t ParameterStore::findKey(const uint16_t start, const char *key, const bool checkSize, const uint16_t pSize) const {
-  char match[KEYSIZE];
-  memset(match, 0, sizeof(match));
-  strncpy(match, key, sizeof(match));
+ps_offset_t ParameterStore::findKey(const ps_offset_t start, const ParameterKey &key, const bool checkSize, const uint16_t pSize, uint16_t *foundBytes) const {
+  PS_STAT(++_stats.lookups);
   // PS_LOG_DEBUG(F("Looking for key %s %s size %d" CR), key, (checkSize ? "checking" : "not checking"), pSize);
 
-  uint16_t offset = sizeof(Header);
+  if (start==0 && _index && _index->isValid()) {
+    return findIndexedKey(key, checkSize, pSize, foundBytes);
+  }
+
+  ps_offset_t offset = sizeof(Header);
   // Walk through entries looking for matching key...
-  while (offset<_size) {
+  while (offset<_end) {
     Entry entry;
-    _store.read(offset, &entry, sizeof(entry));
+    entry.readHeader(_store, offset);
+    PS_STAT(++_stats.entriesScanned);
     const uint16_t size = entry.getSize();
     // if (0==memcmp(entry._name, match, sizeof(match))) {
     //   PS_LOG_DEBUG(F("Found named entry at %d size: %d key: '%s' isFree: %d match: %d start: %d" CR), offset, size, entry._name, (int)entry.isFree(), memcmp(entry._name, match, sizeof(match)), start);
     // }
-    if (offset>=start && !entry.isFree() && 0==memcmp(entry._name, match, sizeof(match))) {
+    if (offset>=start && !entry.isFree() && entry.hasKey(_store, offset, key)) {
       if (checkSize && size!=pSize) {
         offset = _size; // Indicate not found
       }
+      else if (foundBytes) {
+        *foundBytes = entry.totalBytes();
+      }
       break;
     }
+    else if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      return _size; // Corrupt store
+    }
     else {
       offset += entry.totalBytes();
     }
   }
   //PS_LOG_DEBUG(F("Key search for '%s' responds %d (of %d)" CR), key, offset, _size);
-  return offset;
+  return (offset<_end) ? offset : _size;
 }
 
-int ParameterStore::set(const char *key, const uint8_t *buffer, const uint16_t size) {
-  const uint16_t prior = findKey(0, key, false /* don't check size */, size);
-  const bool existing = (prior < _size);
+ps_offset_t ParameterStore::findIndexedKey(const ParameterKey &key, const bool checkSize, const uint16_t pSize, uint16_t *foundBytes) const {
+  uint16_t pos = _index->start(key.hash);
+  for (ps_offset_t offset = _index->probe(key.hash, &pos); offset!=0; offset = _index->probe(key.hash, &pos)) {
+    Entry entry;
+    _store.read(offset, &entry, sizeof(entry));
+    PS_STAT(++_stats.entriesScanned);
+    if (!entry.isFree() && entry.hasKey(_store, offset, key)) {
+      if (checkSize && entry.getSize()!=pSize) {
+        return _size;
+      }
+      if (foundBytes) {
+        *foundBytes = entry.totalBytes();
+      }
+      return offset;
+    }
+  }
+  return _size;
+}
+
+int ParameterStore::set(const ParameterKey &key, const uint8_t *buffer, const uint16_t size) {
+  PS_STAT(++_stats.sets; _stats.valueBytes += size);
+  if (key.length>PS_MAX_KEY_LENGTH) {
+    return PS_ERROR_KEY_TOO_LONG;
+  }
+  if (_txOffset!=0) {
+    return setInTransaction(key, buffer, size);
+  }
+  uint8_t slot;
+  if (findSlot(key, &slot)) {
+    if (size==_schema->slot(slot).size) {
+      return setSlot(slot, key, buffer, size);
+    }
+    _schema->state(slot).elsewhere = true; // Other sizes go in the entry chain
+  }
+  if (_allocation==AllocateRotating && _head==0) {
+    // A log leaves its unwritten space ahead of the head, so carry on from the largest block
+    uint16_t largest;
+    _head = largestFree(&largest);
+  }
+  uint16_t priorBytes = 0;
+  ps_offset_t prior = findKey(0, key, false /* don't check size */, size, &priorBytes);
+  if (prior<_size) {
+    Entry current;
+    current.readHeader(_store, prior);
+    if (current.getSize()==size) {
+      const uint32_t crc = Entry(size, key).calcCrc(_crc, buffer, size, key);
+      // Reading the value as well lets a set() repair a value damaged since its CRC was written
+      if (_store.readu32(prior + current.entryBytes() - CRCSIZE)==crc && sameBytes(_store, prior + sizeof(Entry), buffer, size)) {
+        PS_STAT(++_stats.unchanged);
+        return PS_SUCCESS; // Already stored
+      }
+      if (_allocation==AllocateBestFit && size<=PS_UPDATE_IN_PLACE_BYTES) {
+        return update(prior, key, buffer, size, crc); // Rotation moves every write on, to spread wear
+      }
+    }
+  }
 
-  const uint16_t length = sizeof(Entry) + unitSize(size) + CRCSIZE;
+  Entry entry(size, key);
+  const uint16_t length = entry.entryBytes();
+  if (length==0) {
+    return PS_INSUFFICIENT_SPACE; // Too large for an entry
+  }
 
   // Find free space for storage
   uint16_t foundSize = 0;
-  const uint16_t offset = findFreeSpace(length, &foundSize);
+  ps_offset_t offset = findFreeSpace(length, &foundSize);
+  if (offset>=_size && _allocation==AllocateRotating) {
+    // Rotation leaves free space scattered. Gather it, as compact() in idle time would have.
+    compact();
+    _head = 0;
+    prior = findKey(0, key, false, size, &priorBytes); // May have moved
+    offset = findFreeSpace(length, &foundSize);
+  }
   if (offset>=_size) {
     return PS_INSUFFICIENT_SPACE;
   }
+  const bool existing = (prior < _size);
 
   // Write the entry that splits the free space, if necessary.
   const uint16_t extra = foundSize - length;
@@ -351,47 +922,529 @@ int ParameterStore::set(const char *key, const uint8_t *buffer, const uint16_t s
     Entry::writeFree(_store, offset+length, extra);
   }
 
-  Entry entry(size, key);
-  uint32_t crc = entry.calcCrc(buffer, size);
+  uint32_t crc = entry.calcCrc(_crc, buffer, size, key);
 
   // Write the intention to write offset/length/crc/logcrc to log
-  Header header;
-  header.plan.flag = FlagSet;
-  header.plan.unused = 0;
-  header.plan.setOffset(offset);
-  header.plan.setSize(size);
-  header.plan.setEntryCrc(crc);
-  // In case of error, need to be able to restore this size/flag we're about to overwrite
-  _store.read(offset, &header.plan.restore, sizeof(header.plan.restore));
-  header.plan.setCrc();
-  // Write all but initial flag.
-  _store.write(OFFSET(header, plan.unused), &header.plan.unused, sizeof(header.plan) - 1);
-  // Once plan is written, add flag byte.
-  _store.writebyte(OFFSET(header, plan), header.plan.flag);
+  PlanTag plan;
+  plan.flag = FlagSet;
+  plan.unused = 0;
+  plan.setOffset(offset);
+  plan.setSize(size);
+  plan.setEntryCrc(crc);
+  // In case of error, need to be able to restore the free entry we're about to overwrite
+  plan.setRestoreFree(foundSize);
+  writePlan(_store, _crc, plan);
 
   // Write length, key, buffer, and CRC
   // PS_LOG_DEBUG(F("Set entry for %s responds %d for %d" CR), key, offset, size);
-  entry.write(_store, offset, buffer, crc);
+  entry.write(_store, offset, buffer, crc, key);
 
   // Remove prior value
   if (existing) {
     _store.writebyte(prior + OFFSET(entry, _status._flag), FlagFreed);
   }
 
+  if (_freeMap) {
+    _freeMap->remove(offset, foundSize);
+    if (extra>0) {
+      _freeMap->add(offset+length, extra);
+    }
+  }
+  if (_index) {
+    if (existing) {
+      _index->replace(key.hash, prior, offset);
+    }
+    else {
+      _index->insert(key.hash, offset);
+    }
+  }
+
   // Lastly, write 0 in plan length to indicate completion
-  _store.writebyte(OFFSET(header, plan.flag), FlagFree);
+  clearPlan(_store);
+  _head = offset + length;
 
+  if (existing) {
+    uint16_t merged;
+    coalesce(prior, priorBytes, &merged);
+  }
   return PS_SUCCESS;
 }
-int ParameterStore::set(const char *key, const char *str) {
+
+// Overwrite the value of the entry at offset, which is the same size, instead of writing a
+// new entry and freeing the old. The old value is saved first, in the plan if it fits and
+// otherwise in free space, so recovery can put it back.
+int ParameterStore::update(const ps_offset_t offset, const ParameterKey &key, const uint8_t *buffer, const uint16_t size, const uint32_t crc) {
+  Entry entry(size, key);
+  PlanTag plan;
+  plan.flag = FlagUpdate;
+  plan.unused = 0;
+  plan.setOffset(offset);
+  plan.setSize(size);
+  plan.setEntryCrc(crc);
+  memset(&plan.restore, 0, sizeof(plan.restore));
+  if (size<=sizeof(plan.restore)) {
+    _store.read(offset + sizeof(Entry), &plan.restore, size);
+  }
+  else {
+    // Copy of the old value and CRC goes after the header of a free entry
+    const ps_offset_t backup = findFreeSpace(sizeof(Entry) + size + CRCSIZE, NULL);
+    if (backup>=_size) {
+      return PS_INSUFFICIENT_SPACE;
+    }
+    copyBytes(_store, offset + sizeof(Entry), backup + sizeof(Entry), size);
+    copyBytes(_store, offset + entry.entryBytes() - CRCSIZE, backup + sizeof(Entry) + size, CRCSIZE);
+    const ps_offset_t stored = htonoff(backup);
+    memcpy(&plan.restore, &stored, sizeof(stored));
+  }
+  writePlan(_store, _crc, plan);
+
+  // Value, padding, any name, and CRC. The header stays as it is.
+  entry.write(_store, offset, buffer, crc, key, sizeof(Entry));
+  clearPlan(_store);
+  PS_STAT(++_stats.updates);
   return PS_SUCCESS;
 }
-int ParameterStore::set(const char *key, const uint32_t value) {
+
+// Write a free entry of bytes at offset. Rewriting a size is not atomic, so journal it.
+// Recovery redoes the write.
+void ParameterStore::rewriteFree(const ps_offset_t offset, const uint16_t bytes) {
+  PlanTag plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.flag = FlagMerge;
+  plan.setOffset(offset);
+  plan.setSize(bytes);
+  writePlan(_store, _crc, plan);
+  Entry::writeFree(_store, offset, bytes);
+  clearPlan(_store);
+}
+
+// Merge the free entry at offset (not yet in the free space map) with adjacent free entries.
+// Returns the start of the merged entry and its size in mergedBytes.
+ps_offset_t ParameterStore::coalesce(const ps_offset_t offset, const uint16_t bytes, uint16_t *mergedBytes) {
+  if (offset<_schemaEnd) {
+    *mergedBytes = bytes; // Slots keep their size
+    return offset;
+  }
+  ps_offset_t start = offset;
+  uint16_t total = bytes;
+  ps_offset_t prevOffset;
+  uint16_t prevSize;
+  // Only the map can find the preceding entry without a walk.
+  if (_freeMap && _freeMap->isValid() && _freeMap->findEndingAt(offset, &prevOffset, &prevSize)
+      && ((uint32_t)total + prevSize)<=MAX_EXTENT) {
+    _freeMap->remove(prevOffset, prevSize);
+    start = prevOffset;
+    total += prevSize;
+  }
+  for (ps_offset_t next = offset + bytes; next<_end; ) {
+    Entry entry;
+    entry.readSize(_store, next);
+    const uint16_t nextBytes = entry.totalBytes();
+    if (!entry.isFree() || !isValidExtent(next, nextBytes, _size)
+        || ((uint32_t)total + nextBytes)>MAX_EXTENT) {
+      break;
+    }
+    if (_freeMap) {
+      _freeMap->remove(next, nextBytes);
+    }
+    total += nextBytes;
+    next += nextBytes;
+  }
+
+  if (start!=offset || total!=bytes) {
+    rewriteFree(start, total);
+  }
+
+  if (_freeMap) {
+    _freeMap->add(start, total);
+  }
+  if (start<_compactCursor) {
+    _compactCursor = start;
+  }
+  *mergedBytes = total;
+  return start;
+}
+
+// Copy the live entry at from into the free entry at to, journaled like set().
+void ParameterStore::relocate(const ps_offset_t from, const uint16_t fromBytes, const ps_offset_t to, const uint16_t toBytes) {
+  PS_STAT(++_stats.relocations);
+  Entry entry;
+  _store.read(from, &entry, sizeof(entry));
+
+  const uint16_t extra = toBytes - fromBytes;
+  if (extra>0) {
+    Entry::writeFree(_store, to + fromBytes, extra);
+  }
+
+  PlanTag plan;
+  plan.flag = FlagSet;
+  plan.unused = 0;
+  plan.setOffset(to);
+  plan.setSize(entry.getSize());
+  plan.setEntryCrc(_store.readu32(from + fromBytes - CRCSIZE));
+  plan.setRestoreFree(toBytes);
+  writePlan(_store, _crc, plan);
+
+  // Copy header, value, and CRC in the same order as set()
+  _store.write(to, &entry, sizeof(entry));
+  copyBytes(_store, from + sizeof(Entry), to + sizeof(Entry), fromBytes - sizeof(Entry));
+  _store.writebyte(from + OFFSET(entry, _status._flag), FlagFreed);
+  clearPlan(_store);
+
+  if (_freeMap) {
+    _freeMap->remove(to, toBytes);
+    if (extra>0) {
+      _freeMap->add(to + fromBytes, extra);
+    }
+  }
+  if (_index) {
+    _index->replace(entry.keyHash(), from, to);
+  }
+  uint16_t merged;
+  coalesce(from, fromBytes, &merged);
+}
+
+bool ParameterStore::compact(const uint16_t byteBudget) {
+  if (_txOffset!=0) {
+    return false; // Would move entries into the transaction's block
+  }
+  uint32_t spent = 0;
+  uint16_t stalled = 0; // Size of hole before its neighbour was moved out of the way
+  ps_offset_t offset = MAX(_compactCursor, _schemaEnd);
+  while (offset<_end) {
+    Entry entry;
+    entry.readSize(_store, offset);
+    uint16_t bytes = entry.totalBytes();
+    if (!isValidExtent(offset, bytes, _size)) {
+      PS_LOG_ERROR(F("Corrupt entry at %d. Cannot compact." CR), offset);
+      return true;
+    }
+    if (!entry.isFree()) {
+      offset += bytes;
+      _compactCursor = offset;
+      continue;
+    }
+
+    // Grow this hole by everything free that follows it
+    if (_freeMap) {
+      _freeMap->remove(offset, bytes);
+    }
+    offset = coalesce(offset, bytes, &bytes);
+    const ps_offset_t next = offset + bytes;
+    if (next>=_end) {
+      _compactCursor = offset;
+      return true; // Free space is all at the end
+    }
+
+    Entry nextEntry;
+    nextEntry.readSize(_store, next);
+    const uint16_t nextBytes = nextEntry.totalBytes();
+    if (!isValidExtent(next, nextBytes, _size)) {
+      PS_LOG_ERROR(F("Corrupt entry at %d. Cannot compact." CR), next);
+      return true;
+    }
+    if (nextEntry.isFree()) {
+      offset = next; // Hole is already as large as an entry can be
+      _compactCursor = offset;
+      continue;
+    }
+    if (byteBudget>0 && spent>0 && (spent + nextBytes)>byteBudget) {
+      _compactCursor = offset;
+      return false;
+    }
+
+    // Moving the neighbour away must have grown the hole. If not, the store isn't taking writes.
+    const bool stuck = bytes<=stalled;
+    stalled = 0;
+    if (nextBytes<=bytes) {
+      // Slide the following entry down into the hole
+      relocate(next, nextBytes, offset, bytes);
+      offset += nextBytes;
+    }
+    else {
+      // Too big for the hole. Move it elsewhere so the hole grows, or skip it.
+      uint16_t foundSize = 0;
+      const ps_offset_t to = stuck ? _size : findFreeSpace(nextBytes, &foundSize);
+      if (to<_size) {
+        relocate(next, nextBytes, to, foundSize);
+        stalled = bytes;
+      }
+      else {
+        offset = next + nextBytes;
+      }
+    }
+    spent += nextBytes;
+    _compactCursor = offset;
+  }
+  return true;
+}
+// Largest free block, or _size when there is none
+ps_offset_t ParameterStore::largestFree(uint16_t *foundSize) const {
+  ps_offset_t offset = _size;
+  uint16_t size = 0;
+  if (_freeMap && _freeMap->isValid()) {
+    _freeMap->largest(&offset, &size);
+  }
+  else {
+    Entry entry;
+    for (ps_offset_t at = _schemaEnd; at<_end; at += entry.totalBytes()) {
+      entry.readSize(_store, at);
+      if (!isValidExtent(at, entry.totalBytes(), _size)) {
+        break; // Corrupt store
+      }
+      if (entry.isFree() && entry.totalBytes()>size) {
+        offset = at;
+        size = entry.totalBytes();
+      }
+    }
+  }
+  *foundSize = size;
+  return offset;
+}
+
+bool ParameterStore::beginTransaction() {
+  if (_txOffset!=0) {
+    return false; // Already open
+  }
+  // Entries go in the largest free block. Its free header stays in place until commit.
+  uint16_t size = 0;
+  const ps_offset_t offset = largestFree(&size);
+  if (offset>=_size) {
+    return false;
+  }
+  Entry entry;
+  entry.readSize(_store, offset);
+  if (entry._status._flag!=FlagFree) {
+    rewriteFree(offset, size); // Entries overwrite the name length that a freed entry's length depends on
+  }
+  if (_freeMap && _freeMap->isValid()) {
+    _freeMap->remove(offset, size);
+  }
+  _txOffset = offset;
+  _txSize = size;
+  _txUsed = 0;
+  _loading = false;
+  memset(_txHead, 0, sizeof(_txHead));
+  return true;
+}
+
+bool ParameterStore::beginLoad() {
+  if (_txOffset!=0) {
+    return false; // Already open
+  }
+  if (_crc!=psCrc32) {
+    clear(); // Format 1 store. The load is written in the current format.
+  }
+  if (!beginTransaction()) {
+    return false;
+  }
+  _loading = true;
+  return true;
+}
+
+int ParameterStore::setInTransaction(const ParameterKey &key, const uint8_t *buffer, const uint16_t size) {
+  Entry entry(size, key);
+  const uint16_t length = entry.entryBytes();
+  if (length==0 || (_txSize - _txUsed)<length) {
+    return PS_INSUFFICIENT_SPACE;
+  }
+
+  // A key set twice in one transaction keeps only its last value. Loads skip the check.
+  Entry pending;
+  for (ps_offset_t at = _txOffset; !_loading && at<(_txOffset + _txUsed); at += pending.totalBytes()) {
+    _store.read(at, &pending, sizeof(pending));
+    if (at==_txOffset) {
+      memcpy((uint8_t *)&pending, _txHead, sizeof(_txHead));
+    }
+    if (!isValidExtent(at, pending.totalBytes(), _txOffset + _txUsed)) {
+      break; // Store is not taking writes
+    }
+    if (!pending.isFree() && pending.hasKey(_store, at, key)) {
+      if (at==_txOffset) {
+        _txHead[OFFSET(pending, _status._flag)] = FlagFreed;
+      }
+      else {
+        _store.writebyte(at + OFFSET(pending, _status._flag), FlagFreed);
+      }
+      break;
+    }
+  }
+
+  const uint32_t crc = entry.calcCrc(_crc, buffer, size, key);
+  if (_txUsed==0) {
+    // Keep the first header in RAM so the block still reads as free
+    entry.write(_store, _txOffset, buffer, crc, key, sizeof(_txHead));
+    memcpy(_txHead, &entry, sizeof(_txHead));
+  }
+  else {
+    entry.write(_store, _txOffset + _txUsed, buffer, crc, key);
+  }
+  _txUsed += length;
+  return PS_SUCCESS;
+}
+
+bool ParameterStore::commit() {
+  if (_txOffset==0) {
+    return false;
+  }
+  const ps_offset_t offset = _txOffset;
+  const uint16_t used = _txUsed;
+  const uint16_t extra = _txSize - _txUsed;
+  _txOffset = 0;
+  if (used==0 && !_loading) {
+    if (_freeMap && _freeMap->isValid()) {
+      _freeMap->add(offset, extra);
+    }
+    return true;
+  }
+
+  // Split the block while it is still free
+  if (extra>0) {
+    Entry::writeFree(_store, offset + used, extra);
+  }
+
+  PlanTag plan;
+  plan.flag = _loading ? FlagLoad : FlagTransaction;
+  plan.unused = 0;
+  plan.setOffset(offset);
+  plan.setSize(used);
+  memcpy(&plan.restore, _txHead, sizeof(plan.restore));
+  plan.setEntryCrc(transactionCrc(offset, used, _txHead));
+  writePlan(_store, _crc, plan); // Commit point
+  PS_STAT(++_stats.commits);
+
+  if (_loading) {
+    PS_STAT(++_stats.deserializes);
+    applyLoad(plan);
+    clearPlan(_store);
+    _compactCursor = sizeof(Header);
+    _head = 0;
+    scanSchema();
+    rebuildMaps();
+    return true;
+  }
+
+  applyTransaction(plan);
+  clearPlan(_store);
+
+  if (_freeMap && _freeMap->isValid() && extra>0) {
+    _freeMap->add(offset + used, extra);
+  }
+  return true;
+}
+
+void ParameterStore::abort() {
+  // Nothing was made visible. Return the block to the free space map.
+  if (_txOffset!=0 && _freeMap && _freeMap->isValid()) {
+    _freeMap->add(_txOffset, _txSize);
+  }
+  _txOffset = 0;
+}
+
+// CRC of a transaction's entries, taking the first header from head rather than the store.
+uint32_t ParameterStore::transactionCrc(const ps_offset_t offset, const uint16_t used, const void *head) const {
+  const uint16_t headBytes = sizeof(PlanTag().restore);
+  uint32_t crc = _crc(CRCSEED, (const uint8_t *)head, headBytes);
+  uint8_t buffer[32];
+  for (uint16_t done = headBytes; done<used; ) {
+    const uint16_t chunk = MIN(sizeof(buffer), (unsigned)(used - done));
+    _store.read(offset + done, buffer, chunk);
+    crc = _crc(crc, buffer, chunk);
+    done += chunk;
+  }
+  return crc;
+}
+
+// Write the first header of a committed load and turn everything outside it into free space.
+// Safe to repeat during recovery, since it depends only on the plan.
+void ParameterStore::applyLoad(const PlanTag &plan) {
+  const ps_offset_t start = plan.getOffset();
+  const ps_offset_t end = start + plan.getSize();
+  if (end>start) {
+    _store.write(start, &plan.restore, sizeof(plan.restore));
+  }
+  // Slots stay laid out, with both twins freed
+  Entry entry;
+  for (ps_offset_t offset = sizeof(Header); offset<_schemaEnd; offset += entry.entryBytes()) {
+    entry.readHeader(_store, offset);
+    _store.writebyte(offset + OFFSET(entry, _status._flag), FlagFreed);
+  }
+  writeFreeRun(_store, _schemaEnd, start - _schemaEnd, NULL);
+  writeFreeRun(_store, end, _end - end, NULL);
+}
+
+// Write the first header of a committed transaction and free the values it replaces.
+// Safe to repeat during recovery.
+void ParameterStore::applyTransaction(const PlanTag &plan) {
+  const ps_offset_t start = plan.getOffset();
+  const ps_offset_t end = start + plan.getSize();
+  _store.write(start, &plan.restore, sizeof(plan.restore));
+  Entry entry;
+  for (ps_offset_t offset = start; offset<end; offset += entry.totalBytes()) {
+    _store.read(offset, &entry, sizeof(entry));
+    if (!isValidExtent(offset, entry.totalBytes(), end)) {
+      break; // Corrupt store
+    }
+    if (entry.isFree()) {
+      // Superseded within the transaction
+      if (_freeMap && _freeMap->isValid()) {
+        _freeMap->add(offset, entry.totalBytes());
+      }
+      continue;
+    }
+    char name[PS_MAX_KEY_LENGTH + 1];
+    entry.readKey(_store, offset, name);
+    const ParameterKey key(name);
+    uint16_t priorBytes = 0;
+    ps_offset_t prior = findKey(0, key, false, 0, &priorBytes);
+    while (prior>=start && prior<end) {
+      prior = findKey(prior + 1, key, false, 0, &priorBytes);
+    }
+    uint8_t slot;
+    if (findSlot(key, &slot)) {
+      _schema->state(slot).elsewhere = true;
+    }
+    if (prior<_size) {
+      _store.writebyte(prior + OFFSET(entry, _status._flag), FlagFreed);
+      if (_freeMap && _freeMap->isValid() && prior>=_schemaEnd) {
+        _freeMap->add(prior, priorBytes);
+      }
+      if (prior<_compactCursor) {
+        _compactCursor = prior;
+      }
+    }
+    if (_index && _index->isValid()) {
+      if (prior<_size) {
+        _index->replace(key.hash, prior, offset);
+      }
+      else {
+        _index->insert(key.hash, offset);
+      }
+    }
+  }
+}
+
+int ParameterStore::set(const ParameterKey &key, const char *str) {
+  return PS_SUCCESS;
+}
+int ParameterStore::set(const ParameterKey &key, const uint32_t value) {
   uint32_t storeValue = htonl(value);
   return set(key, (const uint8_t *)&storeValue, sizeof(storeValue));
 }
-int ParameterStore::get(const char *key, uint8_t *buffer, const uint16_t size) const {
-  uint16_t offset = findKey(0, key, true, size);
+int ParameterStore::get(const ParameterKey &key, uint8_t *buffer, const uint16_t size) const {
+  PS_STAT(++_stats.gets);
+  uint8_t slot;
+  if (findSlot(key, &slot)) {
+    const ps_offset_t live = liveSlot(slot);
+    if (live!=0 || !_schema->state(slot).elsewhere) {
+      if (live==0 || size!=_schema->slot(slot).size) {
+        return PS_ERROR_NOT_FOUND;
+      }
+      _store.read(live + sizeof(Entry), buffer, size);
+      return PS_SUCCESS;
+    }
+  }
+  ps_offset_t offset = findKey(0, key, true, size);
   if (offset>=_size) {
     return PS_ERROR_NOT_FOUND;
   }
@@ -399,11 +1452,81 @@ int ParameterStore::get(const char *key, uint8_t *buffer, const uint16_t size) c
   _store.read(offset + sizeof(Entry), buffer, size);
   return PS_SUCCESS;
 }
-int ParameterStore::get(const char *key, char *str, uint16_t size) const {
-  PS_LOG_ERROR(F("Calling unimplemented ParameterStore::get with '%s' %d" CR), key, size);
+int ParameterStore::getMany(ParameterRequest *requests, const uint8_t count) const {
+  int found = 0;
+  if (_index && _index->isValid()) {
+    // Each key is a probe or two anyway
+    for (uint8_t i=0; i<count; ++i) {
+      requests[i].status = get(requests[i].key, requests[i].buffer, requests[i].size);
+      found += (requests[i].status==PS_SUCCESS);
+    }
+    return found;
+  }
+
+  PS_STAT(_stats.gets += count; ++_stats.lookups);
+  const int pending = 1; // Not a PS_ status
+  for (uint8_t i=0; i<count; ++i) {
+    requests[i].status = pending;
+  }
+  uint8_t left = count;
+  Entry entry;
+  for (ps_offset_t offset = sizeof(Header); offset<_end && left>0; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
+    PS_STAT(++_stats.entriesScanned);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
+    if (entry.isFree()) {
+      continue;
+    }
+    for (uint8_t i=0; i<count; ++i) {
+      ParameterRequest &request = requests[i];
+      if (request.status!=pending || !entry.hasKey(_store, offset, request.key)) {
+        continue;
+      }
+      if (entry.getSize()==request.size) {
+        _store.read(offset + sizeof(Entry), request.buffer, request.size);
+        request.status = PS_SUCCESS;
+        ++found;
+      }
+      else {
+        request.status = PS_ERROR_NOT_FOUND;
+      }
+      --left;
+    }
+  }
+  for (uint8_t i=0; i<count; ++i) {
+    if (requests[i].status==pending) {
+      requests[i].status = PS_ERROR_NOT_FOUND;
+    }
+  }
+  return found;
+}
+
+int ParameterStore::view(const ParameterKey &key, const uint8_t **value, uint16_t *size) const {
+  PS_STAT(++_stats.gets);
+  const ps_offset_t offset = findKey(0, key, false, 0);
+  if (offset>=_size) {
+    return PS_ERROR_NOT_FOUND;
+  }
+  Entry entry;
+  entry.readHeader(_store, offset);
+  const uint8_t *bytes = _store.address(offset + sizeof(Entry), entry.getSize());
+  if (!bytes) {
+    return PS_ERROR_NOT_ADDRESSABLE;
+  }
+  if (!entry.checkCrc(_crc, _store, offset, bytes, key)) {
+    return PS_ERROR_CRC;
+  }
+  *value = bytes;
+  *size = entry.getSize();
+  return PS_SUCCESS;
+}
+int ParameterStore::get(const ParameterKey &key, char *str, uint16_t size) const {
+  PS_LOG_ERROR(F("Calling unimplemented ParameterStore::get with '%s' %d" CR), key.name, size);
   return PS_ERROR_NOT_FOUND;
 }
-int ParameterStore::get(const char *key, uint32_t *value) const {
+int ParameterStore::get(const ParameterKey &key, uint32_t *value) const {
   uint32_t storeValue = 0;
   int ret = get(key, (uint8_t *)&storeValue, sizeof(storeValue));
   if (ret==PS_SUCCESS) {
@@ -412,91 +1535,220 @@ int ParameterStore::get(const char *key, uint32_t *value) const {
   return ret;
 }
 
-int ParameterStore::serialize(char *buffer, const size_t size) const {
+int ParameterStore::forEach(EntryVisitor visit, void *context, uint8_t *scratch, const uint16_t scratchSize) const {
+  Entry entry;
+  int visited = 0;
+  for (ps_offset_t offset = sizeof(Header); offset<_end; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
+    if (!entry.isFree()) {
+      char name[PS_MAX_KEY_LENGTH + 1];
+      entry.readKey(_store, offset, name);
+      const ParameterEntry found = {
+        name,
+        entry.getSize(),
+        offset,
+        (scratch && entry.getSize()<=scratchSize) ? scratch : NULL,
+      };
+      if (found.value) {
+        _store.read(offset + sizeof(Entry), scratch, found.size);
+      }
+      ++visited;
+      if (!visit(context, found)) {
+        break;
+      }
+    }
+  }
+  return visited;
+}
+
+int ParameterStore::readValue(const ParameterEntry &entry, const uint16_t from, uint8_t *buffer, const uint16_t size) const {
+  if (from>entry.size || size>(entry.size - from)) {
+    return PS_ERROR_NOT_FOUND;
+  }
+  _store.read(entry.offset + sizeof(Entry) + from, buffer, size);
+  return PS_SUCCESS;
+}
+
+int ParameterStore::serialize(SerializeSink sink, void *context) const {
+  PS_STAT(++_stats.serializes);
   // Walk through all entries\...
   Entry entry;
-  size_t fill = 0;
-  for (uint16_t offset = sizeof(Header); offset<_size; offset += entry.totalBytes()) {
-    _store.read(offset, &entry, sizeof(entry));
+  int total = 0;
+  for (ps_offset_t offset = sizeof(Header); offset<_end; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
     //PS_LOG_DEBUG(F("Read entry at %d size %d key '%s'" CR), offset, size, entry._name);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
     if (!entry.isFree()) {
       // Write entry key=value where key is ASCII and value is a string of hex digits.
-      for (char *nm = entry._name; *nm!='\0' && (nm - entry._name)<8; ++nm) {
-        buffer[fill++] = *nm;
-        if (fill==size) {
-          return -1;
-        }
-      }
-
-      buffer[fill++] = '=';
-      if (fill==size) {
+      char name[PS_MAX_KEY_LENGTH + 2];
+      entry.readKey(_store, offset, name);
+      size_t length = strlen(name);
+      name[length++] = '=';
+      if (!sink(context, name, length)) {
         return -1;
       }
+      total += length;
 
+      // Value goes out a chunk at a time so that memory use doesn't depend on its size
+      uint8_t value[SERIALIZE_CHUNK];
+      char hex[2 * sizeof(value)];
       const uint16_t esize = entry.getSize();
-      uint8_t value[esize];
-      _store.read(offset + sizeof(Entry), value, esize);
-      if (size<(fill+2*esize)) {
-        return -1;
+      for (uint16_t done = 0; done<esize; ) {
+        const uint16_t chunk = MIN(sizeof(value), (unsigned)(esize - done));
+        _store.read(offset + sizeof(Entry) + done, value, chunk);
+        length = formatHexBytes(hex, value, chunk);
+        if (!sink(context, hex, length)) {
+          return -1;
+        }
+        total += length;
+        done += chunk;
       }
-      fill += formatHexBytes(&buffer[fill], value, esize);
 
       // Newline terminate
-      buffer[fill++] = '\n';
-      if (fill==size) {
+      if (!sink(context, "\n", 1)) {
         return -1;
       }
+      ++total;
     }
   }
-  buffer[fill++] = '\0';
-  if (fill==size) {
+  return total;
+}
+
+struct BufferSink {
+  char *buffer;
+  size_t size;
+  size_t fill;
+};
+
+// Leaves a byte spare, so the text plus '\0' must fit.
+static bool appendToBuffer(void *context, const char *text, size_t length) {
+  BufferSink *sink = (BufferSink *)context;
+  if ((sink->fill + length)>=sink->size) {
+    return false;
+  }
+  memcpy(sink->buffer + sink->fill, text, length);
+  sink->fill += length;
+  return true;
+}
+
+int ParameterStore::serialize(char *buffer, const size_t size) const {
+  BufferSink sink = { buffer, size, 0 };
+  if (serialize(appendToBuffer, &sink)<0 || !appendToBuffer(&sink, "", 1)) {
     return -1;
   }
-  return fill;
+  return sink.fill;
 }
 
-bool ParameterStore::deserializeLine(const char *buffer, const char *eol) {
-  // PS_LOG_DEBUG(F("deserializeLine '%p' '%p'" CR), buffer, eol);
+static bool printTo(void *context, const char *text, size_t length) {
+  return ((Print *)context)->write((const uint8_t *)text, length)==length;
+}
 
-  const char *eq = strstr(buffer, "=");
-  if (eq==NULL || (eq-buffer)>8 || eq>=eol) {
-    return false;
+int ParameterStore::serialize(Print &out) const {
+  return serialize(printTo, &out);
+}
+
+// Hands snapshot bytes to a sink, keeping the CRC of everything sent.
+struct SnapshotWriter {
+  SerializeSink sink;
+  void *context;
+  uint32_t crc;
+  int total;
+
+  bool put(const void *bytes, const uint16_t size) {
+    crc = psCrc32(crc, (const uint8_t *)bytes, size);
+    total += size;
+    return sink(context, (const char *)bytes, size);
   }
-  char key[8+1];
-  size_t nlen = eq-buffer;
-  strncpy(key, buffer, nlen);
-  key[nlen] = '\0';
+};
 
-  buffer = eq + 1;
-  size_t digits = (eol - buffer);
-  if ((digits % 2)!=0) {
-    // Can't handle odd number of hex digits
-    return false;
+int ParameterStore::snapshot(SerializeSink sink, void *context) const {
+  PS_STAT(++_stats.serializes);
+  SnapshotWriter out = { sink, context, 0, 0 };
+  if (!out.put(SNAPSHOT_START, sizeof(SNAPSHOT_START))) {
+    return -1;
   }
-  uint8_t value[digits / 2];
-  size_t d = 0;
-  while (buffer!=eol) {
-    uint8_t b = 0xF0 & (nibble(*(buffer++)) << 4);
-    b += 0x0F & nibble(*(buffer++));
-    value[d++] = b;
+  Entry entry;
+  for (ps_offset_t offset = sizeof(Header); offset<_end; offset += entry.totalBytes()) {
+    entry.readHeader(_store, offset);
+    if (!isValidExtent(offset, entry.totalBytes(), _size)) {
+      break; // Corrupt store
+    }
+    if (!entry.isFree()) {
+      char name[PS_MAX_KEY_LENGTH + 1];
+      entry.readKey(_store, offset, name);
+      const uint8_t keyLength = strlen(name);
+      const uint8_t size[] = { (uint8_t)(entry.getSize() >> 8), (uint8_t)entry.getSize() };
+      if (!out.put(&keyLength, sizeof(keyLength)) || !out.put(name, keyLength) || !out.put(size, sizeof(size))) {
+        return -1;
+      }
+      uint8_t value[SNAPSHOT_CHUNK];
+      const uint16_t esize = entry.getSize();
+      for (uint16_t done = 0; done<esize; ) {
+        const uint16_t chunk = MIN(sizeof(value), (unsigned)(esize - done));
+        _store.read(offset + sizeof(Entry) + done, value, chunk);
+        if (!out.put(value, chunk)) {
+          return -1;
+        }
+        done += chunk;
+      }
+    }
   }
-  PS_ASSERT((2*d)==digits);
-  set(key, value, digits / 2);
-  return true;
+  const uint8_t last = 0;
+  if (!out.put(&last, sizeof(last))) {
+    return -1;
+  }
+  // Snapshots move between devices, so byte order is fixed whatever htonl() does here
+  const uint8_t crc[] = { (uint8_t)(out.crc >> 24), (uint8_t)(out.crc >> 16), (uint8_t)(out.crc >> 8), (uint8_t)out.crc };
+  if (!out.put(crc, sizeof(crc))) {
+    return -1;
+  }
+  return out.total;
 }
 
-bool ParameterStore::deserialize(const char *buffer, const size_t size) {
-  // Clear store...
+int ParameterStore::snapshot(Print &out) const {
+  return snapshot(printTo, &out);
+}
+
+void ParameterStore::clear() {
   Header header;
-  _store.writeu16(OFFSET(header, size), _size);
-  Entry::writeFree(_store, sizeof(Header), _size - sizeof(Header));
+  const ps_offset_t storeSize = htonoff(_size);
+  _store.write(OFFSET(header, size), &storeSize, sizeof(storeSize));
+  if (_freeMap) {
+    _freeMap->clear();
+  }
+  layOutSchema();
+  writeFreeRun(_store, _schemaEnd, _end - _schemaEnd, _freeMap);
   // Write format last...if it succeeds, we have valid header
   _store.writeu16(OFFSET(header, format), FORMAT);
+  _store.sync();
+  _crc = psCrc32;
+  if (_index) {
+    _index->clear();
+  }
+  _compactCursor = sizeof(Header);
+  _head = 0;
+  _txOffset = 0;
+  _loading = false;
+}
 
-  bool ok = true;
-  for (const char *eol = strstr(buffer, "\n"); eol!=NULL; buffer = eol + 1, eol = strstr(buffer, "\n")) {
-    ok = ok && deserializeLine(buffer, eol);
+bool ParameterStore::deserialize(const char *buffer, const size_t size) {
+  FixedDeserializer<PS_DESERIALIZE_VALUE_BYTES> parser(*this);
+  const size_t length = strnlen(buffer, size);
+  if (!parser.begin()) {
+    return false;
+  }
+  parser.write(buffer, length);
+  const bool ok = parser.end();
+  if (!parser.full()) {
+    return ok;
   }
-  ok = ok && deserializeLine(buffer, buffer + strlen(buffer) + 1); // Handle possible last line with no terminator.
-  return ok;
+  // Old and new contents don't fit side by side. Clear first, as before loads.
+  parser.begin(false);
+  parser.write(buffer, length);
+  return parser.end();
 }
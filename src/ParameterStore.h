@@ -42,35 +42,358 @@
 
 #define CR "\r\n"
 
+#define PS_ERROR_CRC -5
+#define PS_ERROR_NOT_ADDRESSABLE -4
+#define PS_ERROR_KEY_TOO_LONG -3
 #define PS_INSUFFICIENT_SPACE -2
 #define PS_ERROR_NOT_FOUND -1
 #define PS_SUCCESS 0
 
 #include "NonVolatileStore.h"
+#include "KeyIndex.h"
+#include "FreeSpaceMap.h"
+#include "Crc32.h"
 struct HeaderTag;
+struct PlanTag;
+class Deserializer;
+class ParameterSchema;
+
+// Define PS_HASHED_KEYS to store each key's full name and hash. Otherwise names are cut to 8 characters.
+#if defined(PS_HASHED_KEYS)
+  #if !defined(PS_MAX_KEY_LENGTH)
+    #define PS_MAX_KEY_LENGTH 32 // Longest name set() accepts, at most 255
+  #endif
+#else
+  #define PS_MAX_KEY_LENGTH 8
+#endif
+
+constexpr uint8_t keyLength(const char *key, const size_t maxLength) {
+  return (maxLength==0 || *key=='\0') ? 0 : 1 + keyLength(key + 1, maxLength - 1);
+}
+
+// Key name with its hash, worked out once per call rather than per entry compared.
+// Declare keys constexpr to hash them at compile time:
+//   constexpr ParameterKey CalibX1("calib_x1");
+struct ParameterKey {
+  const char *name;
+  uint8_t length; // Over PS_MAX_KEY_LENGTH means too long
+  uint32_t hash;
+  constexpr ParameterKey(const char *name)
+    : name(name),
+#if defined(PS_HASHED_KEYS)
+      length(keyLength(name, PS_MAX_KEY_LENGTH + 1)),
+#else
+      length(keyLength(name, PS_MAX_KEY_LENGTH)),
+#endif
+      hash(hashKey(name, PS_MAX_KEY_LENGTH)) {
+  }
+  constexpr ParameterKey(const char *name, const uint8_t length, const uint32_t hash)
+    : name(name), length(length), hash(hash) {
+  }
+};
+
+template <uint32_t Value> struct PsConstant {
+  static const uint32_t value = Value;
+};
+
+// Key for a literal name, hashed at compile time even where the key isn't declared constexpr:
+//   paramStore.get(PS_KEY("calib_x1"), calibration);
+#define PS_KEY(name) ParameterKey(name, PsConstant<ParameterKey(name).length>::value, PsConstant<ParameterKey(name).hash>::value)
+
+// Converts typed values to and from their stored bytes for the typed get() and set().
+// Integers are stored big endian, as set(key, uint32_t) does. Arrays are converted an
+// element at a time. Other types, such as structs, are stored as their bytes.
+template <typename T> struct ParameterCodec {
+  static void encode(const T &value, uint8_t *bytes) {
+    memcpy(bytes, &value, sizeof(T));
+  }
+  static void decode(const uint8_t *bytes, T &value) {
+    memcpy(&value, bytes, sizeof(T));
+  }
+};
+template <typename T, size_t N> struct ParameterCodec<T[N]> {
+  static void encode(const T (&value)[N], uint8_t *bytes) {
+    for (size_t i=0; i<N; ++i) {
+      ParameterCodec<T>::encode(value[i], bytes + i * sizeof(T));
+    }
+  }
+  static void decode(const uint8_t *bytes, T (&value)[N]) {
+    for (size_t i=0; i<N; ++i) {
+      ParameterCodec<T>::decode(bytes + i * sizeof(T), value[i]);
+    }
+  }
+};
+template <size_t N> struct ParameterCodec<uint8_t[N]> {
+  static void encode(const uint8_t (&value)[N], uint8_t *bytes) {
+    memcpy(bytes, value, N);
+  }
+  static void decode(const uint8_t *bytes, uint8_t (&value)[N]) {
+    memcpy(value, bytes, N);
+  }
+};
+// Integers are keyed on the fundamental types, so int, long and long long convert on every
+// platform whichever of them the uintN_t typedefs name.
+template <typename T> struct ParameterIsInteger {
+  static const bool value = false;
+};
+template <typename T> struct ParameterIntegerCodec {
+  static void encode(const T &value, uint8_t *bytes) {
+    const unsigned long long stored = (unsigned long long)value;
+    for (size_t i=0; i<sizeof(T); ++i) {
+      bytes[i] = (uint8_t)(stored >> (8 * (sizeof(T) - 1 - i)));
+    }
+  }
+  static void decode(const uint8_t *bytes, T &value) {
+    unsigned long long stored = 0;
+    for (size_t i=0; i<sizeof(T); ++i) {
+      stored = (stored << 8) | bytes[i];
+    }
+    value = (T)stored;
+  }
+};
+#define PS_INTEGER_CODEC(T) \
+  template <> struct ParameterIsInteger<T> { static const bool value = true; }; \
+  template <> struct ParameterCodec<T> : ParameterIntegerCodec<T> {};
+PS_INTEGER_CODEC(bool)
+PS_INTEGER_CODEC(char)
+PS_INTEGER_CODEC(signed char)
+PS_INTEGER_CODEC(unsigned char)
+PS_INTEGER_CODEC(short)
+PS_INTEGER_CODEC(unsigned short)
+PS_INTEGER_CODEC(int)
+PS_INTEGER_CODEC(unsigned int)
+PS_INTEGER_CODEC(long)
+PS_INTEGER_CODEC(unsigned long)
+PS_INTEGER_CODEC(long long)
+PS_INTEGER_CODEC(unsigned long long)
+#undef PS_INTEGER_CODEC
+
+// Stored form of a typed value. Integers narrower than 32 bits are stored as 4 bytes, as
+// set(key, uint32_t) stores them, so they read back with get(key, uint32_t *) and the reverse.
+template <typename T, bool Widen = ParameterIsInteger<T>::value && (sizeof(T) < sizeof(uint32_t))>
+struct ParameterValue {
+  static const size_t size = sizeof(T);
+  static void encode(const T &value, uint8_t *bytes) {
+    ParameterCodec<T>::encode(value, bytes);
+  }
+  static void decode(const uint8_t *bytes, T &value) {
+    ParameterCodec<T>::decode(bytes, value);
+  }
+};
+template <typename T> struct ParameterValue<T, true> {
+  static const size_t size = sizeof(uint32_t);
+  static void encode(const T &value, uint8_t *bytes) {
+    ParameterCodec<uint32_t>::encode((uint32_t)value, bytes);
+  }
+  static void decode(const uint8_t *bytes, T &value) {
+    uint32_t stored;
+    ParameterCodec<uint32_t>::decode(bytes, stored);
+    value = (T)stored;
+  }
+};
+
+template <typename T> struct ParameterIsPointer {
+  static const bool value = false;
+};
+template <typename T> struct ParameterIsPointer<T *> {
+  static const bool value = true;
+};
+
+// One key for getMany(), which sets status as get() would return it.
+struct ParameterRequest {
+  ParameterKey key;
+  uint8_t *buffer;
+  uint16_t size;
+  int status;
+};
+
+// One live entry, as passed to a forEach() visitor
+struct ParameterEntry {
+  const char *name;
+  uint16_t size;
+  ps_offset_t offset;
+  const uint8_t *value; // In the scratch buffer, or NULL if not read
+};
+
+// Called by forEach() for each entry. Return false to stop.
+typedef bool (*EntryVisitor)(void *context, const ParameterEntry &entry);
+
+// Receives serialize() text a piece at a time. Return false to stop serializing.
+typedef bool (*SerializeSink)(void *context, const char *text, size_t length);
+
+// How set() chooses free space for an entry
+enum AllocationMode {
+  AllocateBestFit, // Smallest free block that fits, keeping large blocks whole, and small same-size values in place. Suits FRAM.
+  AllocateRotating, // First block that fits after the last write, wrapping around, to spread wear on EEPROM and flash
+};
+
+#if defined(PS_STATS)
+struct ParameterStoreStats {
+  uint32_t gets;
+  uint32_t sets;
+  uint32_t valueBytes;     // Bytes passed to set(). Compare with store writeBytes for write amplification.
+  uint32_t commits;
+  uint32_t relocations;    // Entries moved by compact()
+  uint32_t updates;        // Sets that overwrote a value of the same size in place
+  uint32_t unchanged;      // Sets of the value already stored, which write nothing
+  uint32_t lookups;
+  uint32_t entriesScanned; // Entry headers read by lookups
+  uint32_t recoveries;     // Interrupted operations finished or undone by begin()
+  uint32_t serializes;
+  uint32_t deserializes;   // Loads committed
+};
+#endif
+
+#if !defined(PS_DESERIALIZE_VALUE_BYTES)
+  #define PS_DESERIALIZE_VALUE_BYTES 256 // Largest value deserialize() restores. Use FixedDeserializer for more.
+#endif
+#if !defined(PS_UPDATE_IN_PLACE_BYTES)
+  // Largest value set() overwrites in place. Saving a larger old value costs more than a new entry.
+  #define PS_UPDATE_IN_PLACE_BYTES 16
+#endif
 
 class ParameterStore {
+  friend class Deserializer; // May clear the store before a load
+  friend class SnapshotReader;
   NonVolatileStore &_store;
-  const uint16_t _size;
+  const ps_offset_t _size;
+  const ps_offset_t _end; // Entries stop at the last whole unit. Stores from before this may run to _size.
+  KeyIndex *_index;
+  FreeSpaceMap *_freeMap;
+  ps_offset_t _compactCursor; // Entries before this offset are already compacted
+  CrcFunction _crc; // Depends on store format
+  ps_offset_t _txOffset; // Free block holding the open transaction, 0 when none
+  uint16_t _txSize;
+  uint16_t _txUsed;
+  uint8_t _txHead[4]; // Size and status of the first entry, written by commit()
+  bool _loading; // Open transaction is a load from beginLoad()
+  ParameterSchema *_schema;
+  ps_offset_t _schemaEnd; // Slots stop here, and the entry chain's free space starts
+  AllocationMode _allocation;
+  ps_offset_t _head; // Rotating allocation looks for space from here
+#if defined(PS_STATS)
+  mutable ParameterStoreStats _stats;
+#endif
 public:
-  ParameterStore(NonVolatileStore &store);
+  // index and freeMap are optional. When supplied, lookups and allocation
+  // consult them instead of walking the store. schema, also optional, gives its keys
+  // fixed slots (see ParameterSchema.h).
+  ParameterStore(NonVolatileStore &store, KeyIndex *index = NULL, FreeSpaceMap *freeMap = NULL, ParameterSchema *schema = NULL);
   bool begin();
+  // After begin(), AllocateRotating carries on from the largest free block.
+  void setAllocation(const AllocationMode mode) {
+    _allocation = mode;
+  }
 
-  int set(const char *key, const uint8_t *buffer, const uint16_t size);
-  int set(const char *key, const char *str);
-  int set(const char *key, const uint32_t value);
+  int set(const ParameterKey &key, const uint8_t *buffer, const uint16_t size);
+  int set(const ParameterKey &key, const char *str);
+  int set(const ParameterKey &key, const uint32_t value);
+  // An int literal is stored as 4 bytes, as before typed set(), even where int is 16 bits
+  int set(const ParameterKey &key, const int value) {
+    return set(key, (uint32_t)value);
+  }
 
-  int get(const char *key, uint8_t *buffer, const uint16_t size) const;
-  int get(const char *key, char *str, uint16_t size) const;
-  int get(const char *key, uint32_t *value) const;
+  // Group set() calls so that they all take effect or none do, even across power failure.
+  // Until commit(), set() writes into the largest free block and get() returns committed values.
+  // Call compact() first if free space is fragmented.
+  bool beginTransaction();
+  bool commit();
+  void abort();
+  // Open a transaction whose commit() replaces the whole store, for restores. set() appends
+  // each entry after the last without looking up keys, so each key must be set only once.
+  // The old contents stay readable until commit(), and power failure leaves either them or
+  // the complete load. Both must fit at once: the load goes in the largest free block.
+  bool beginLoad();
+  bool inTransaction() const { return _txOffset!=0; }
 
+  int get(const ParameterKey &key, uint8_t *buffer, const uint16_t size) const;
+  int get(const ParameterKey &key, char *str, uint16_t size) const;
+  int get(const ParameterKey &key, uint32_t *value) const;
+  // Typed values, including structs and fixed arrays, sized at compile time. Integers of up to
+  // 32 bits share one 4 byte form; otherwise store and read a key with the same type, since a
+  // value of another size reads as PS_ERROR_NOT_FOUND.
+  template <typename T>
+  int set(const ParameterKey &key, const T &value) {
+    static_assert(__has_trivial_copy(T) && !ParameterIsPointer<T>::value, "Stored values must be plain data, not pointers");
+    uint8_t bytes[ParameterValue<T>::size];
+    ParameterValue<T>::encode(value, bytes);
+    return set(key, bytes, ParameterValue<T>::size);
+  }
+  template <typename T>
+  int get(const ParameterKey &key, T &value) const {
+    static_assert(__has_trivial_copy(T) && !ParameterIsPointer<T>::value, "Stored values must be plain data, not pointers");
+    uint8_t bytes[ParameterValue<T>::size];
+    const int ret = get(key, bytes, ParameterValue<T>::size);
+    if (ret==PS_SUCCESS) {
+      ParameterValue<T>::decode(bytes, value);
+    }
+    return ret;
+  }
+  // Fill many requests in one walk of the store instead of one walk per get().
+  // Returns the number found.
+  int getMany(ParameterRequest *requests, const uint8_t count) const;
+  // Point value at the stored bytes instead of copying them, once the entry's CRC checks out.
+  // Needs a backend that overrides addressImpl(), such as RamStore, and otherwise returns
+  // PS_ERROR_NOT_ADDRESSABLE. Returns PS_ERROR_CRC for a damaged entry. The pointer stays
+  // valid until the key is set again, or the store is compacted or loaded.
+  int view(const ParameterKey &key, const uint8_t **value, uint16_t *size) const;
+
+  // Move live entries toward the start of the store so that free space is merged at the end.
+  // byteBudget limits the bytes relocated per call (0 for no limit) so that compaction can
+  // be spread over several calls. Returns true once compaction is complete.
+  bool compact(const uint16_t byteBudget = 0);
+
+  // Call visit for each live entry in one walk of the store. Values that fit in scratch are
+  // read into it first. Read larger ones in pieces with readValue(). The store must not be
+  // changed during the walk. Returns the number of entries visited.
+  int forEach(EntryVisitor visit, void *context, uint8_t *scratch = NULL, const uint16_t scratchSize = 0) const;
+  // Read size bytes of a visited entry's value, starting from byte from.
+  int readValue(const ParameterEntry &entry, const uint16_t from, uint8_t *buffer, const uint16_t size) const;
+
+  // Write each entry as a key=hex line. The buffer form adds a terminating '\0' and returns
+  // -1 if the text doesn't fit. The sink and Print forms stream the text in small pieces
+  // using constant memory, and return the length written or -1 if the output stopped.
   int serialize(char *buffer, const size_t size) const;
+  int serialize(SerializeSink sink, void *context) const;
+  int serialize(Print &out) const;
+  // Replace the store's contents with the text from serialize(). For text that arrives
+  // in pieces, or values over PS_DESERIALIZE_VALUE_BYTES, use a FixedDeserializer.
   bool deserialize(const char *buffer, const size_t size);
+  // Write every entry to a binary snapshot (see Snapshot.h), a small piece at a time.
+  // Returns the length written or -1 if the output stopped. Read it with a FixedSnapshotReader.
+  int snapshot(SerializeSink sink, void *context) const;
+  int snapshot(Print &out) const;
+
+#if defined(PS_STATS)
+  // Operation counts since construction or resetStats(). Store I/O is in the store's own stats().
+  const ParameterStoreStats &stats() const { return _stats; }
+  void resetStats() {
+    memset(&_stats, 0, sizeof(_stats));
+  }
+#endif
 private:
   bool recoverPlan(const struct HeaderTag &header);
-  uint16_t findFreeSpace(uint16_t unitSize, uint16_t *foundSize) const;
-  uint16_t findKey(const uint16_t start, const char *key, const bool checkSize, const uint16_t size) const;
-  bool deserializeLine(const char *buffer, const char *eol);
+  ps_offset_t findFreeSpace(uint16_t unitSize, uint16_t *foundSize) const;
+  ps_offset_t largestFree(uint16_t *foundSize) const;
+  ps_offset_t findKey(const ps_offset_t start, const ParameterKey &key, const bool checkSize, const uint16_t size, uint16_t *foundBytes = NULL) const;
+  ps_offset_t findIndexedKey(const ParameterKey &key, const bool checkSize, const uint16_t size, uint16_t *foundBytes) const;
+  void rebuildMaps();
+  int update(const ps_offset_t offset, const ParameterKey &key, const uint8_t *buffer, const uint16_t size, const uint32_t crc);
+  void restoreUpdate(const struct PlanTag &plan);
+  void rewriteFree(const ps_offset_t offset, const uint16_t bytes);
+  ps_offset_t coalesce(const ps_offset_t offset, const uint16_t bytes, uint16_t *mergedBytes);
+  void relocate(const ps_offset_t from, const uint16_t fromBytes, const ps_offset_t to, const uint16_t toBytes);
+  int setInTransaction(const ParameterKey &key, const uint8_t *buffer, const uint16_t size);
+  uint32_t transactionCrc(const ps_offset_t offset, const uint16_t used, const void *head) const;
+  void applyTransaction(const struct PlanTag &plan);
+  void applyLoad(const struct PlanTag &plan);
+  void clear();
+  void layOutSchema();
+  void checkSchema();
+  void scanSchema();
+  bool findSlot(const ParameterKey &key, uint8_t *slot) const;
+  ps_offset_t liveSlot(const uint8_t slot) const;
+  int setSlot(const uint8_t slot, const ParameterKey &key, const uint8_t *buffer, const uint16_t size);
 };
 
 // Utility function - buffer must be 2*count+1 size.
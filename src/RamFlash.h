@@ -0,0 +1,47 @@
+#ifndef RAMFLASH_H
+#define RAMFLASH_H
+
+#include "FlashDevice.h"
+
+// Flash simulated in RAM, for tests and native builds. Keeps to flash's rules: programs
+// are aligned to the granularity and only go to erased bytes. Counts erases per block.
+template <uint32_t Size, uint32_t BlockSize, uint8_t Granularity = 4>
+class RamFlash : public FlashDevice {
+  static_assert((Granularity & (Granularity - 1))==0, "Write granularity should be a power of two");
+  uint8_t _bytes[Size];
+  uint32_t _erases[Size / BlockSize];
+  const uint32_t _eraseMicros;
+
+public:
+  RamFlash(const uint32_t eraseMicros = 20000)
+    : _eraseMicros(eraseMicros) {
+    memset(_bytes, 0xFF, sizeof(_bytes));
+    memset(_erases, 0, sizeof(_erases));
+  }
+
+  virtual uint32_t size() const { return Size; }
+  virtual uint32_t eraseBlockSize() const { return BlockSize; }
+  virtual uint8_t writeGranularity() const { return Granularity; }
+  virtual uint32_t eraseMicros() const { return _eraseMicros; }
+  uint32_t eraseCount(const uint32_t block) const { return _erases[block]; }
+
+  virtual void read(uint32_t offset, void *buffer, uint16_t size) const {
+    PS_ASSERT_MSG((offset + size)<=Size, "Flash read should be within Size");
+    memcpy(buffer, _bytes + offset, size);
+  }
+  virtual void program(uint32_t offset, const void *bytes, uint16_t size) {
+    PS_ASSERT_MSG((offset + size)<=Size, "Flash program should be within Size");
+    PS_ASSERT_MSG((offset & (Granularity - 1))==0 && (size & (Granularity - 1))==0, "Flash program should be aligned");
+    for (uint16_t i=0; i<size; ++i) {
+      PS_ASSERT_MSG(_bytes[offset + i]==0xFF, "Flash program should be to erased bytes");
+      _bytes[offset + i] &= ((const uint8_t *)bytes)[i];
+    }
+  }
+  virtual void erase(uint32_t block) {
+    PS_ASSERT_MSG(block<(Size / BlockSize), "Flash erase should be within Size");
+    memset(_bytes + block * BlockSize, 0xFF, BlockSize);
+    ++_erases[block];
+  }
+};
+
+#endif
@@ -3,7 +3,7 @@
 
 #include "NonVolatileStore.h"
 
-template <uint16_t Size>
+template <ps_offset_t Size>
 class RamStore : public NonVolatileStore {
   uint8_t _bytes[Size];
   mutable uint32_t lastOffset = 50000;
@@ -23,7 +23,7 @@ public:
     NonVolatileStore::resetStore();
   }
 protected:
-  virtual void readImpl(uint16_t offset, void *buf, uint16_t size) const {
+  virtual void readImpl(ps_offset_t offset, void *buf, uint16_t size) const {
     // PS_LOG_DEBUG(F("readImpl offset %d size %d" CR), offset-sizeof(uint32_t), size);
     PS_ASSERT_MSG(count<10, "Reading same offset over and over");
     PS_ASSERT_MSG(offset<Size, "readImpl offset should be within Size");
@@ -31,7 +31,7 @@ protected:
     memcpy(buf, _bytes + offset, size);
     // dumpBytes((uint8_t *)buf, size);
   }
-  virtual void writeImpl(uint16_t offset, const void *buf, uint16_t size) {
+  virtual void writeImpl(ps_offset_t offset, const void *buf, uint16_t size) {
     // PS_LOG_DEBUG(F("Write count %d with fail at %d" CR), _byteWriteCount, _failAfter);
     PS_ASSERT_MSG(offset<Size, "writeImpl offset should be within Size");
     PS_ASSERT_MSG((offset+size)<=Size, "writeImpl offset+size should be within Size");
@@ -39,6 +39,9 @@ protected:
     memcpy(_bytes + offset, buf, size);
     // dumpBytes((uint8_t *)buf, size);
   }
+  virtual const uint8_t *addressImpl(ps_offset_t offset) const {
+    return _bytes + offset;
+  }
 };
 
 #endif
\ No newline at end of file
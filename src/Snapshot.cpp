@@ -0,0 +1,135 @@
+#include "Snapshot.h"
+
+SnapshotReader::SnapshotReader(ParameterStore &store, uint8_t *value, uint16_t capacity)
+  : _store(store), _value(value), _capacity(capacity),
+    _keyLength(0), _size(0), _count(0), _crc(0), _state(StateStart), _skip(false), _ok(true), _full(false), _loading(false)
+{
+}
+
+bool SnapshotReader::begin(const bool keepOld) {
+  _loading = false;
+  _full = false;
+  _ok = false;
+  if (_store.inTransaction()) {
+    PS_LOG_ERROR(F("Can't load while a transaction is open" CR));
+    return false; // The caller's transaction is left open
+  }
+  if (!keepOld) {
+    _store.clear();
+  }
+  _count = 0;
+  _crc = 0;
+  _state = StateStart;
+  _skip = false;
+  _full = !_store.beginLoad();
+  _ok = !_full;
+  _loading = true;
+  return true;
+}
+
+void SnapshotReader::endEntry() {
+  if (_skip) {
+    _ok = false;
+  }
+  else if (!_full) {
+    _key[_keyLength] = '\0';
+    const int result = _store.set(_key, _value, _size);
+    _full = (result==PS_INSUFFICIENT_SPACE);
+    _ok = (result==PS_SUCCESS) && _ok;
+  }
+  _count = 0;
+  _skip = false;
+  _state = StateKeyLength;
+}
+
+bool SnapshotReader::write(const uint8_t *bytes, size_t length) {
+  if (!_loading) {
+    return false;
+  }
+  size_t i = 0;
+  while (i<length && _state!=StateDone && _state!=StateBad) {
+    if (_state==StateValue) {
+      // Values are copied a run at a time
+      const uint16_t n = MIN((size_t)(_size - _count), length - i);
+      if (!_skip) {
+        memcpy(_value + _count, bytes + i, n);
+      }
+      _crc = psCrc32(_crc, bytes + i, n);
+      _count += n;
+      i += n;
+      if (_count==_size) {
+        endEntry();
+      }
+      continue;
+    }
+    const uint8_t b = bytes[i++];
+    if (_state!=StateCrc) {
+      _crc = psCrc32(_crc, &b, 1);
+    }
+    switch (_state) {
+      case StateStart:
+        _field[_count++] = b;
+        if (_count==sizeof(SNAPSHOT_START)) {
+          _count = 0;
+          _state = (memcmp(_field, SNAPSHOT_START, sizeof(SNAPSHOT_START))==0) ? StateKeyLength : StateBad;
+        }
+        break;
+      case StateKeyLength:
+        _keyLength = b;
+        _skip = (b>PS_MAX_KEY_LENGTH);
+        _state = (b==0) ? StateCrc : StateKey;
+        break;
+      case StateKey:
+        if (!_skip) {
+          _key[_count] = b;
+        }
+        if (++_count==_keyLength) {
+          _count = 0;
+          _state = StateSize;
+        }
+        break;
+      case StateSize:
+        _field[_count++] = b;
+        if (_count==2) {
+          _size = (_field[0] << 8) | _field[1];
+          _skip = _skip || _size>_capacity;
+          _count = 0;
+          if (_size==0) {
+            endEntry();
+          }
+          else {
+            _state = StateValue;
+          }
+        }
+        break;
+      case StateCrc:
+        _field[_count++] = b;
+        if (_count==4) {
+          const uint32_t crc = ((uint32_t)_field[0] << 24) | ((uint32_t)_field[1] << 16) | ((uint32_t)_field[2] << 8) | _field[3];
+          _state = (crc==_crc) ? StateDone : StateBad;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  if (_state==StateBad) {
+    _ok = false;
+  }
+  return _ok;
+}
+
+bool SnapshotReader::end() {
+  if (!_loading) {
+    return false;
+  }
+  _loading = false;
+  if (_state==StateDone && !_full) {
+    _store.commit();
+  }
+  else {
+    _ok = false;
+    _store.abort();
+  }
+  return _ok;
+}
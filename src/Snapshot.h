@@ -0,0 +1,79 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "ParameterStore.h"
+
+/*
+ * Binary snapshot written by ParameterStore::snapshot(). Half the size of the
+ * serialize() text and no hex to encode or decode. Numbers are big endian.
+ *  2  MAGIC       'P' 'S'
+ *  1  VERSION     PS_SNAPSHOT_VERSION
+ * Then for each entry
+ *  1  KEY-LENGTH  0 ends the entries
+ *  K  KEY
+ *  2  SIZE
+ *  N  VALUE
+ * Then
+ *  4  CRC         CRC-32 of every byte before it
+ */
+#define PS_SNAPSHOT_VERSION 1
+
+const uint8_t SNAPSHOT_START[] = { 'P', 'S', PS_SNAPSHOT_VERSION };
+
+/*
+ * Push parser for snapshots. Feed it chunks of any size and the entries are bulk
+ * loaded with ParameterStore::beginLoad(). end() commits the load only if the
+ * snapshot was complete and its CRC matched, so a damaged snapshot changes nothing.
+ * Values are copied into the buffer supplied by FixedSnapshotReader. An entry
+ * larger than that buffer, or with a key over PS_MAX_KEY_LENGTH, is skipped.
+ */
+class SnapshotReader {
+  enum State {
+    StateStart,
+    StateKeyLength,
+    StateKey,
+    StateSize,
+    StateValue,
+    StateCrc,
+    StateDone,
+    StateBad, // Not a snapshot this reader understands
+  };
+  ParameterStore &_store;
+  uint8_t *_value;
+  const uint16_t _capacity;
+  char _key[PS_MAX_KEY_LENGTH + 1];
+  uint8_t _keyLength;
+  uint16_t _size;
+  uint16_t _count; // Bytes of the current field read so far
+  uint8_t _field[4]; // Start, size, or CRC as it arrives
+  uint32_t _crc;
+  uint8_t _state;
+  bool _skip; // Current entry can't be stored
+  bool _ok;
+  bool _full; // Load ran out of space. end() abandons it.
+  bool _loading; // begin() opened the load
+
+  void endEntry();
+public:
+  // Start a load. keepOld and the return value work as for Deserializer::begin().
+  bool begin(const bool keepOld = true);
+  // Parse more of the snapshot. Returns false once anything has failed.
+  bool write(const uint8_t *bytes, size_t length);
+  // Commit the load if the whole snapshot arrived intact. Returns true if every entry
+  // was stored. Otherwise the old contents remain, unless begin(false) cleared them.
+  bool end();
+  bool full() const { return _full; }
+protected:
+  SnapshotReader(ParameterStore &store, uint8_t *value, uint16_t capacity);
+};
+
+template <uint16_t ValueBytes>
+class FixedSnapshotReader : public SnapshotReader {
+  uint8_t _storage[ValueBytes];
+public:
+  FixedSnapshotReader(ParameterStore &store)
+    : SnapshotReader(store, _storage, ValueBytes) {
+  }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "WriteBackCache.h"
+
+WriteBackCache::WriteBackCache(ParameterStore &store, Line *lines, uint8_t *values, const uint8_t count, const uint16_t valueBytes,
+                               const uint16_t maxDirtyBytes, const uint32_t flushMillis)
+  : _store(store), _lines(lines), _values(values), _count(count), _valueBytes(valueBytes),
+    _maxDirtyBytes(maxDirtyBytes), _flushMillis(flushMillis), _dirtyBytes(0), _now(0), _dirtySince(0), _clock(0), _folds(0)
+{
+  memset(_lines, 0, count * sizeof(Line));
+}
+
+// Line holding key, or _count if none
+uint8_t WriteBackCache::find(const ParameterKey &key) const {
+  for (uint8_t i=0; i<_count; ++i) {
+    const Line &line = _lines[i];
+    if (line.used!=0 && line.hash==key.hash && strncmp(line.name, key.name, PS_MAX_KEY_LENGTH)==0) {
+      return i;
+    }
+  }
+  return _count;
+}
+
+// An empty or least recently used clean line, named for key. _count if every line is dirty.
+uint8_t WriteBackCache::claim(const ParameterKey &key) {
+  uint8_t victim = _count;
+  for (uint8_t i=0; i<_count; ++i) {
+    const Line &line = _lines[i];
+    if (!line.dirty && (victim==_count || line.used<_lines[victim].used)) {
+      victim = i;
+    }
+  }
+  if (victim<_count) {
+    Line &line = _lines[victim];
+    strncpy(line.name, key.name, PS_MAX_KEY_LENGTH);
+    line.name[PS_MAX_KEY_LENGTH] = '\0';
+    line.length = key.length;
+    line.hash = key.hash;
+    line.size = 0;
+    line.used = 0;
+  }
+  return victim;
+}
+
+void WriteBackCache::drop(const uint8_t line) {
+  if (_lines[line].dirty) {
+    _dirtyBytes -= _lines[line].size;
+    _lines[line].dirty = false;
+  }
+  _lines[line].used = 0;
+}
+
+// Returns the error of the last value that failed to write
+int WriteBackCache::writeBack() {
+  int ret = PS_SUCCESS;
+  for (uint8_t i=0; i<_count; ++i) {
+    Line &line = _lines[i];
+    if (line.dirty) {
+      const int written = _store.set(ParameterKey(line.name, line.length, line.hash), _values + i * _valueBytes, line.size);
+      if (written==PS_SUCCESS) {
+        line.dirty = false;
+        _dirtyBytes -= line.size;
+      }
+      else {
+        ret = written;
+      }
+    }
+  }
+  return ret;
+}
+
+int WriteBackCache::set(const ParameterKey &key, const uint8_t *buffer, const uint16_t size) {
+  uint8_t line = find(key);
+  if (size>_valueBytes || key.length>PS_MAX_KEY_LENGTH) {
+    const int ret = _store.set(key, buffer, size);
+    if (ret==PS_SUCCESS && line<_count) {
+      drop(line); // Superseded. A dirty value stays to be written if this one wasn't.
+    }
+    return ret;
+  }
+  if (line==_count) {
+    line = claim(key);
+    if (line==_count) {
+      writeBack();
+      line = claim(key);
+      if (line==_count) {
+        return _store.set(key, buffer, size);
+      }
+    }
+  }
+
+  Line &entry = _lines[line];
+  uint8_t *value = _values + line * _valueBytes;
+  const bool same = entry.used!=0 && entry.size==size && memcmp(value, buffer, size)==0;
+  entry.used = ++_clock;
+  if (same) {
+    return PS_SUCCESS; // Already stored, or waiting to be
+  }
+  if (entry.dirty) {
+    _dirtyBytes -= entry.size;
+    ++_folds;
+  }
+  else if (_dirtyBytes==0) {
+    _dirtySince = _now;
+  }
+  memcpy(value, buffer, size);
+  entry.size = size;
+  entry.dirty = true;
+  _dirtyBytes += size;
+  if (_dirtyBytes>_maxDirtyBytes) {
+    writeBack(); // Values that don't fit stay dirty, for flush() to report
+  }
+  return PS_SUCCESS;
+}
+
+int WriteBackCache::get(const ParameterKey &key, uint8_t *buffer, const uint16_t size) {
+  uint8_t line = find(key);
+  if (line<_count) {
+    Line &entry = _lines[line];
+    if (size!=entry.size) {
+      return PS_ERROR_NOT_FOUND; // As the store answers a get() of the wrong size
+    }
+    memcpy(buffer, _values + line * _valueBytes, size);
+    entry.used = ++_clock;
+    return PS_SUCCESS;
+  }
+  const int ret = _store.get(key, buffer, size);
+  if (ret==PS_SUCCESS && size<=_valueBytes && key.length<=PS_MAX_KEY_LENGTH) {
+    line = claim(key);
+    if (line<_count) {
+      memcpy(_values + line * _valueBytes, buffer, size);
+      _lines[line].size = size;
+      _lines[line].used = ++_clock;
+    }
+  }
+  return ret;
+}
+
+bool WriteBackCache::flush() {
+  return writeBack()==PS_SUCCESS;
+}
+
+bool WriteBackCache::poll(const uint32_t now) {
+  _now = now;
+  if (_dirtyBytes==0 || (now - _dirtySince)<_flushMillis) {
+    return true;
+  }
+  return flush();
+}
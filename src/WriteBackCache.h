@@ -0,0 +1,107 @@
+#ifndef WRITEBACKCACHE_H
+#define WRITEBACKCACHE_H
+
+#include "ParameterStore.h"
+
+/*
+ * Write-back cache in front of a ParameterStore, for values set many times a second,
+ * such as counters and timestamps. set() only updates RAM, so a run of sets of one key
+ * costs a single store write. Dirty values are written with ordinary set() calls, each
+ * power safe, by flush(), by poll() once they have waited flushMillis, and by set() once
+ * more than maxDirtyBytes are waiting.
+ *
+ * Values not yet written are lost on power failure or reset: at most maxDirtyBytes of
+ * them, set within about flushMillis plus the time between poll() calls. A maxDirtyBytes
+ * of 0 writes every set() through. Call flush() before sleeping or resetting.
+ *
+ * A cached set() succeeds once the value is in RAM, even if writing dirty values back
+ * then fails, e.g. for lack of space. Those values stay dirty and flush() reports them.
+ *
+ * Set cached keys only through the cache, and not during a transaction or load. Values
+ * over ValueBytes bypass the cache. Clean lines are reused least recently used first.
+ */
+class WriteBackCache {
+public:
+  struct Line {
+    char name[PS_MAX_KEY_LENGTH + 1];
+    uint8_t length;
+    uint32_t hash;
+    uint16_t size;
+    bool dirty; // Newer than the store
+    uint32_t used; // Last use stamp, 0 means empty
+  };
+private:
+  ParameterStore &_store;
+  Line *_lines;
+  uint8_t *_values;
+  const uint8_t _count;
+  const uint16_t _valueBytes;
+  uint16_t _maxDirtyBytes;
+  uint32_t _flushMillis;
+  uint16_t _dirtyBytes;
+  uint32_t _now; // Time given to the last poll()
+  uint32_t _dirtySince; // Time of the last poll() before the oldest dirty value was set
+  uint32_t _clock;
+  uint32_t _folds;
+
+  uint8_t find(const ParameterKey &key) const;
+  uint8_t claim(const ParameterKey &key);
+  void drop(const uint8_t line);
+  int writeBack();
+
+protected:
+  WriteBackCache(ParameterStore &store, Line *lines, uint8_t *values, const uint8_t count, const uint16_t valueBytes,
+                 const uint16_t maxDirtyBytes, const uint32_t flushMillis);
+
+public:
+  int set(const ParameterKey &key, const uint8_t *buffer, const uint16_t size);
+  int get(const ParameterKey &key, uint8_t *buffer, const uint16_t size);
+  template <typename T>
+  int set(const ParameterKey &key, const T &value) {
+    static_assert(__has_trivial_copy(T) && !ParameterIsPointer<T>::value, "Stored values must be plain data, not pointers");
+    uint8_t bytes[ParameterValue<T>::size];
+    ParameterValue<T>::encode(value, bytes);
+    return set(key, bytes, ParameterValue<T>::size);
+  }
+  int set(const ParameterKey &key, const int value) {
+    return set(key, (uint32_t)value);
+  }
+  template <typename T>
+  int get(const ParameterKey &key, T &value) {
+    static_assert(__has_trivial_copy(T) && !ParameterIsPointer<T>::value, "Stored values must be plain data, not pointers");
+    uint8_t bytes[ParameterValue<T>::size];
+    const int ret = get(key, bytes, ParameterValue<T>::size);
+    if (ret==PS_SUCCESS) {
+      ParameterValue<T>::decode(bytes, value);
+    }
+    return ret;
+  }
+
+  // Write every dirty value to the store. Returns false if any didn't fit, and those stay dirty.
+  bool flush();
+  // Call from loop() with millis(). Flushes once dirty values have waited flushMillis.
+  bool poll(const uint32_t now);
+
+  void setFlushThreshold(const uint16_t maxDirtyBytes) {
+    _maxDirtyBytes = maxDirtyBytes;
+  }
+  void setFlushInterval(const uint32_t flushMillis) {
+    _flushMillis = flushMillis;
+  }
+  uint16_t dirtyBytes() const { return _dirtyBytes; }
+  // Sets that replaced a value not yet written, saving a store write each
+  uint32_t folds() const { return _folds; }
+};
+
+// Lines values of up to ValueBytes each
+template <uint8_t Lines, uint16_t ValueBytes = 8>
+class FixedWriteBackCache : public WriteBackCache {
+  Line _lineStorage[Lines];
+  uint8_t _valueStorage[Lines * ValueBytes];
+public:
+  FixedWriteBackCache(ParameterStore &store, const uint16_t maxDirtyBytes = 64, const uint32_t flushMillis = 1000)
+    : WriteBackCache(store, _lineStorage, _valueStorage, Lines, ValueBytes, maxDirtyBytes, flushMillis) {
+  }
+};
+
+#endif
@@ -4,6 +4,15 @@
 
 #include <cstdlib> // rand
 #include "src/ParameterStore.h"
+#include "src/CachedStore.h"
+#include "src/RamStore.h"
+#include "src/MmapFileStore.h"
+#include "src/Deserializer.h"
+#include "src/Snapshot.h"
+#include "src/ParameterSchema.h"
+#include "src/RamFlash.h"
+#include "src/FlashLogStore.h"
+#include "src/WriteBackCache.h"
 extern char hexDigit(uint8_t b);
 
 void dumpBytes(const uint8_t *buffer, const uint16_t size) {
@@ -13,7 +22,7 @@ void dumpBytes(const uint8_t *buffer, const uint16_t size) {
   PS_LOG_DEBUG(F("" CR));
 }
 
-template <uint16_t Size>
+template <ps_offset_t Size>
 class TestStore : public NonVolatileStore {
   uint8_t _bytes[Size];
   mutable uint32_t lastOffset = 50000;
@@ -21,6 +30,7 @@ class TestStore : public NonVolatileStore {
   uint32_t _failAfter = 0; // 0 means don't, otherwise don't write any more after nth byte
   // mutable uint32_t _operationCount = 0;
   uint32_t _byteWriteCount = 0;
+  mutable uint32_t _readCount = 0;
 
 public:
   TestStore()
@@ -36,6 +46,10 @@ public:
     return _byteWriteCount;
   }
 
+  uint32_t getReadCount() {
+    return _readCount;
+  }
+
   virtual bool begin() {
     return NonVolatileStore::begin();
   }
@@ -45,7 +59,7 @@ public:
     setFailAfterWritingBytes(0); // Default is no failures
   }
 protected:
-  virtual void readImpl(uint16_t offset, void *buf, uint16_t size) const {
+  virtual void readImpl(ps_offset_t offset, void *buf, uint16_t size) const {
     // PS_LOG_DEBUG(F("readImpl offset %d size %d" CR), offset-sizeof(uint32_t), size);
     if (offset!=lastOffset) {
       count = 0;
@@ -60,10 +74,11 @@ protected:
     TEST_ASSERT_TRUE_MESSAGE(count<10, "Reading same offset over and over");
     TEST_ASSERT_TRUE_MESSAGE(offset<Size, "readImpl offset should be within Size");
     TEST_ASSERT_TRUE_MESSAGE((offset+size)<=Size, "readImpl offset+size should be within Size");
+    ++_readCount;
     memcpy(buf, _bytes + offset, size);
     // dumpBytes((uint8_t *)buf, size);
   }
-  virtual void writeImpl(uint16_t offset, const void *buf, uint16_t size) {
+  virtual void writeImpl(ps_offset_t offset, const void *buf, uint16_t size) {
     // PS_LOG_DEBUG(F("Write count %d with fail at %d" CR), _byteWriteCount, _failAfter);
     TEST_ASSERT_TRUE_MESSAGE(offset<Size, "writeImpl offset should be within Size");
     TEST_ASSERT_TRUE_MESSAGE((offset+size)<=Size, "writeImpl offset+size should be within Size");
@@ -92,6 +107,14 @@ protected:
 };
 
 const int STORE_SIZE = 2000;
+#if defined(PS_HASHED_KEYS)
+// Names follow the value, padded to 4 bytes, and are read to confirm a hash match
+#define NAME_BYTES(name) ((strlen(name) + 3) / 4 * 4)
+#define NAME_READS 1
+#else
+#define NAME_BYTES(name) 0
+#define NAME_READS 0
+#endif
 TestStore<STORE_SIZE> testStore;
 ParameterStore paramStore(testStore);
 
@@ -306,11 +329,13 @@ void test_multiple_writes(void) {
   }
 }
 
-void test_multiple_writes_with_error(void) {
+void multipleWritesWithError(KeyIndex *index, FreeSpaceMap *freeMap, const AllocationMode mode = AllocateBestFit) {
   PS_LOG_DEBUG(F("Initializing byteStore/paramStore" CR));
   TestStore<STORE_SIZE> byteStore;
-  ParameterStore paramStore(byteStore);
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore, index, freeMap);
   bool ok = paramStore.begin();
+  paramStore.setAllocation(mode);
   TEST_ASSERT_TRUE_MESSAGE(ok, "Began failStore");
 
   Datum *data[20];
@@ -325,6 +350,9 @@ void test_multiple_writes_with_error(void) {
     // Change value....
     Datum *last = d;
     data[di] = d = d->clone()->randomize();
+    while (d->check(paramStore)) {
+      d->randomize(); // Short values can repeat, and then old and new can't be told apart
+    }
 
     // Update datum in store. Figure out how many total bytes were written.
     TestStore<2000> prechangeStore = byteStore;
@@ -339,15 +367,16 @@ void test_multiple_writes_with_error(void) {
       // PS_LOG_DEBUG(F("Writing limited bytes to: %d" CR), i);
       TestStore<2000> testStore = prechangeStore;
 
-      ParameterStore failStore(testStore);
+      ParameterStore failStore(testStore, index, freeMap);
       ok = failStore.begin();
       TEST_ASSERT_TRUE_MESSAGE(ok, "Began failStore");
+      failStore.setAllocation(mode);
       testStore.setFailAfterWritingBytes(i);
       d->store(failStore); // After i bytes, nothing more is written (simulating power failure on device)
 
       // Power up device with same store.
       testStore.setFailAfterWritingBytes(0); // Disable failures
-      ParameterStore recoverStore(testStore);
+      ParameterStore recoverStore(testStore, index, freeMap);
       ok = recoverStore.begin();
       TEST_ASSERT_TRUE_MESSAGE(ok, "Began recoverStore");
 
@@ -365,9 +394,81 @@ void test_multiple_writes_with_error(void) {
       }
     }
     TEST_ASSERT_TRUE_MESSAGE(newValue, "Should have finished wih new value accessible");
+
+    // Continue from the completed write
+    ok = paramStore.begin();
+    TEST_ASSERT_TRUE_MESSAGE(ok, "Began paramStore");
   }
 }
 
+void test_multiple_writes_with_error(void) {
+  multipleWritesWithError(NULL, NULL);
+}
+
+// Values keep their sizes, so best fit updates them in place. Rotation writes each to a new entry.
+void test_multiple_writes_with_error_rotating(void) {
+  multipleWritesWithError(NULL, NULL, AllocateRotating);
+}
+
+// Leaves a freed 64 byte entry for "a", the largest free block, between the header and "b".
+static void makeFreedEntry(TestStore<176> &byteStore) {
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE(paramStore.begin());
+  uint8_t big[64];
+  memset(big, 0xAB, sizeof(big));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("a", big, sizeof(big)));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("b", (uint32_t)0xB0B0));
+  const uint8_t small[] = { 1, 2 };
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("a", small, sizeof(small)));
+}
+
+// Reuse the freed entry for a key whose name takes more units, by set() and in a
+// transaction, cutting power at every byte
+void test_reuse_freed_with_error(void) {
+  const char *longKey = "twenty_character_key";
+  for (int transaction=0; transaction<2; ++transaction) {
+    TestStore<176> byteStore;
+    makeFreedEntry(byteStore);
+    uint32_t total = 0xFFFFFFFF;
+    for (uint32_t failAt = 1; failAt<total; ++failAt) {
+      TestStore<176> failStore = byteStore;
+      ParameterStore failing(failStore);
+      TEST_ASSERT_TRUE(failing.begin());
+      failStore.setFailAfterWritingBytes(failAt);
+      if (transaction) {
+        TEST_ASSERT_TRUE(failing.beginTransaction());
+      }
+      failing.set(longKey, (uint32_t)42);
+      if (transaction) {
+        failing.commit();
+      }
+      if (failStore.getBytesWritten()<=failAt) {
+        total = failAt; // Completed
+      }
+      failStore.setFailAfterWritingBytes(0);
+
+      ParameterStore recovered(failStore);
+      TEST_ASSERT_TRUE(recovered.begin());
+      uint32_t value = 0;
+      TEST_ASSERT_EQUAL_MESSAGE(PS_SUCCESS, recovered.get("b", value), "Later entry survives");
+      TEST_ASSERT_EQUAL(0xB0B0, value);
+      uint8_t small[2];
+      TEST_ASSERT_EQUAL(PS_SUCCESS, recovered.get("a", small, sizeof(small)));
+      TEST_ASSERT_EQUAL(2, small[1]);
+      const int found = recovered.get(longKey, value);
+      TEST_ASSERT_TRUE(found==PS_ERROR_NOT_FOUND || (found==PS_SUCCESS && value==42));
+      TEST_ASSERT_TRUE_MESSAGE(failAt<total || found==PS_SUCCESS, "Completed set is kept");
+    }
+  }
+}
+
+void test_multiple_writes_with_error_mapped(void) {
+  FixedKeyIndex<32> index;
+  FixedFreeSpaceMap<32> freeMap;
+  multipleWritesWithError(&index, &freeMap);
+}
+
 void test_serialize_deserialize(void) {
   Datum *data[20];
   makeTestEntries(paramStore, data, ELEMENTS(data));
@@ -401,6 +502,989 @@ void test_serialize_deserialize(void) {
   }
 }
 
+// Collects streamed text, noting the largest piece handed over
+class TextCollector : public Print {
+public:
+  char text[1500];
+  size_t fill = 0;
+  size_t largest = 0;
+  size_t limit = sizeof(text);
+  virtual size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    largest = MAX(largest, size);
+    const size_t n = MIN(size, limit - fill);
+    memcpy(text + fill, buffer, n);
+    fill += n;
+    return n;
+  }
+};
+
+static bool collect(void *context, const char *text, size_t length) {
+  return length==((TextCollector *)context)->write((const uint8_t *)text, length);
+}
+
+void test_serialize_streaming(void) {
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  uint8_t big[200];
+  memset(big, 0xA5, sizeof(big));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("big", big, sizeof(big)));
+
+  char buffer[1500];
+  const int size = paramStore.serialize(buffer, sizeof(buffer));
+  TEST_ASSERT_TRUE(size>0);
+
+  // Sink and Print get the same text, without the '\0', in small pieces
+  TextCollector sunk;
+  TEST_ASSERT_EQUAL(size - 1, paramStore.serialize(collect, &sunk));
+  TEST_ASSERT_EQUAL(size - 1, sunk.fill);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer, sunk.text, size - 1);
+  TEST_ASSERT_TRUE_MESSAGE(sunk.largest<=32, "Bounded pieces");
+
+  TextCollector printed;
+  TEST_ASSERT_EQUAL(size - 1, paramStore.serialize(printed));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(buffer, printed.text, size - 1);
+
+  // Output that stops accepting text ends the dump
+  TextCollector full;
+  full.limit = 100;
+  TEST_ASSERT_EQUAL(-1, paramStore.serialize(full));
+
+  sunk.text[sunk.fill] = '\0';
+  paramStore.deserialize(sunk.text, sunk.fill);
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value after deserialize");
+  }
+}
+
+void test_deserialize_chunks(void) {
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  char buffer[1500];
+  const int size = paramStore.serialize(buffer, sizeof(buffer));
+  TEST_ASSERT_TRUE(size>0);
+
+  // Text arrives a few characters at a time
+  FixedDeserializer<16> parser(paramStore);
+  parser.begin();
+  for (int done = 0; done<size - 1; ) {
+    const int random = 1 + rand() % 7;
+    const int chunk = MIN(random, size - 1 - done);
+    TEST_ASSERT_TRUE(parser.write(buffer + done, chunk));
+    done += chunk;
+  }
+  TEST_ASSERT_TRUE(parser.end());
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value after chunked deserialize");
+  }
+
+  // serialize() counts the terminating NUL, and the whole of it can be fed back
+  TEST_ASSERT_TRUE(parser.begin());
+  TEST_ASSERT_TRUE(parser.write(buffer, size));
+  TEST_ASSERT_TRUE(parser.end());
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value after deserializing the NUL too");
+  }
+
+  // Bad lines are skipped and reported. CRLF and a missing last newline are fine.
+  const char *text = "good=0102\r\nodd=123\nbad=ZZ\nlong=000102030405060708090A0B0C0D0E0F10\nlast=AB";
+  parser.begin();
+  TEST_ASSERT_FALSE(parser.write(text, strlen(text)));
+  TEST_ASSERT_FALSE(parser.end());
+  uint8_t value[2];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("good", value, 2));
+  TEST_ASSERT_EQUAL(0x02, value[1]);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("last", value, 1));
+  TEST_ASSERT_EQUAL(0xAB, value[0]);
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("odd", value, 1));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("bad", value, 1));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("long", value, 1));
+  TEST_ASSERT_FALSE_MESSAGE(data[0]->check(paramStore), "begin() cleared earlier values");
+
+  // A caller's open transaction is refused, not discarded
+  TEST_ASSERT_TRUE(paramStore.beginTransaction());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("pending", (uint32_t)7));
+  TEST_ASSERT_FALSE(parser.begin());
+  TEST_ASSERT_FALSE(parser.write(text, strlen(text)));
+  TEST_ASSERT_FALSE(parser.end());
+  TEST_ASSERT_FALSE(paramStore.deserialize(text, strlen(text)));
+  TEST_ASSERT_TRUE(paramStore.inTransaction());
+  TEST_ASSERT_TRUE(paramStore.commit());
+  uint32_t pending = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("pending", pending));
+  TEST_ASSERT_EQUAL(7, pending);
+  TEST_ASSERT_EQUAL_MESSAGE(PS_SUCCESS, paramStore.get("good", value, 2), "Store not cleared");
+}
+
+void test_snapshot(void) {
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  char text[1500];
+  const int textSize = paramStore.serialize(text, sizeof(text));
+  TextCollector snap;
+  const int size = paramStore.snapshot(collect, &snap);
+  TEST_ASSERT_EQUAL(size, (int)snap.fill);
+  TEST_ASSERT_TRUE_MESSAGE(size<textSize, "Snapshot is smaller than the text");
+  TEST_ASSERT_TRUE_MESSAGE(snap.largest<=32, "Bounded pieces");
+  TextCollector printed;
+  TEST_ASSERT_EQUAL(size, paramStore.snapshot(printed));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(snap.text, printed.text, size);
+
+  // Restore into a fresh store a few bytes at a time
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore restored(byteStore);
+  TEST_ASSERT_TRUE(restored.begin());
+  FixedSnapshotReader<16> reader(restored);
+  reader.begin();
+  for (int done = 0; done<size; ) {
+    const int random = 1 + rand() % 7;
+    const int chunk = MIN(random, size - done);
+    TEST_ASSERT_TRUE(reader.write((const uint8_t *)snap.text + done, chunk));
+    done += chunk;
+  }
+  TEST_ASSERT_TRUE(reader.end());
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(restored), "Read value after snapshot restore");
+  }
+
+  // A damaged or cut short snapshot changes nothing
+  Datum *next = data[0]->clone()->randomize();
+  TEST_ASSERT_TRUE(next->store(paramStore));
+  paramStore.snapshot(collect, &(snap = TextCollector()));
+  snap.text[size / 2] ^= 0x10;
+  reader.begin();
+  reader.write((const uint8_t *)snap.text, size);
+  TEST_ASSERT_FALSE(reader.end());
+  snap.text[size / 2] ^= 0x10;
+  reader.begin();
+  reader.write((const uint8_t *)snap.text, size - 1);
+  TEST_ASSERT_FALSE(reader.end());
+  TEST_ASSERT_TRUE_MESSAGE(data[0]->check(restored), "Old value kept");
+  reader.begin();
+  reader.write((const uint8_t *)snap.text, size);
+  TEST_ASSERT_TRUE(reader.end());
+  TEST_ASSERT_TRUE_MESSAGE(next->check(restored), "New value restored");
+
+  // Unknown version
+  snap.text[2] = PS_SNAPSHOT_VERSION + 1;
+  reader.begin();
+  TEST_ASSERT_FALSE(reader.write((const uint8_t *)snap.text, size));
+  TEST_ASSERT_FALSE(reader.end());
+  TEST_ASSERT_TRUE(next->check(restored));
+
+  // A caller's open transaction is refused, not discarded
+  snap.text[2] = PS_SNAPSHOT_VERSION;
+  TEST_ASSERT_TRUE(restored.beginTransaction());
+  TEST_ASSERT_FALSE(reader.begin());
+  TEST_ASSERT_FALSE(reader.write((const uint8_t *)snap.text, size));
+  TEST_ASSERT_FALSE(reader.end());
+  TEST_ASSERT_TRUE(restored.inTransaction());
+  restored.abort();
+}
+
+void test_get_many(void) {
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  uint32_t values[10];
+  ParameterRequest requests[ELEMENTS(values) + 2] = {
+    { "many000", NULL, 0, 0 }, { "many001", NULL, 0, 0 }, { "many002", NULL, 0, 0 }, { "many003", NULL, 0, 0 },
+    { "many004", NULL, 0, 0 }, { "many005", NULL, 0, 0 }, { "many006", NULL, 0, 0 }, { "many007", NULL, 0, 0 },
+    { "many008", NULL, 0, 0 }, { "many009", NULL, 0, 0 }, { "absent", NULL, 0, 0 }, { "many003", NULL, 0, 0 },
+  };
+  for (unsigned i=0; i<ELEMENTS(values); ++i) {
+    TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(requests[i].key, (uint32_t)(i * 7)));
+    requests[i].buffer = (uint8_t *)&values[i];
+    requests[i].size = sizeof(values[i]);
+  }
+  uint8_t spare[2];
+  requests[10].buffer = requests[11].buffer = spare;
+  requests[10].size = requests[11].size = sizeof(spare); // Wrong size for many003
+
+  const uint32_t reads = testStore.getReadCount();
+  TEST_ASSERT_EQUAL(ELEMENTS(values), paramStore.getMany(requests, ELEMENTS(requests)));
+  const uint32_t manyReads = testStore.getReadCount() - reads;
+  for (unsigned i=0; i<ELEMENTS(values); ++i) {
+    TEST_ASSERT_EQUAL(PS_SUCCESS, requests[i].status);
+    TEST_ASSERT_EQUAL(i * 7, ntohl(values[i]));
+  }
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, requests[10].status);
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, requests[11].status);
+
+  // One walk reads far less than a walk per key
+  for (unsigned i=0; i<ELEMENTS(requests); ++i) {
+    paramStore.get(requests[i].key, requests[i].buffer, requests[i].size);
+  }
+  TEST_ASSERT_TRUE_MESSAGE(manyReads * 4<(testStore.getReadCount() - reads - manyReads), "Single walk");
+
+  // Same results through an index
+  TestStore<STORE_SIZE> byteStore = testStore;
+  FixedKeyIndex<64> index;
+  ParameterStore indexed(byteStore, &index);
+  TEST_ASSERT_TRUE(indexed.begin());
+  memset(values, 0, sizeof(values));
+  TEST_ASSERT_EQUAL(ELEMENTS(values), indexed.getMany(requests, ELEMENTS(requests)));
+  TEST_ASSERT_EQUAL(9 * 7, ntohl(values[9]));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, requests[11].status);
+}
+
+// Tallies forEach() visits, stopping after limit
+struct Visits {
+  int count;
+  int limit;
+  bool valuesMatch;
+  const ParameterStore *store;
+};
+
+static bool visitEntry(void *context, const ParameterEntry &entry) {
+  Visits *visits = (Visits *)context;
+  ++visits->count;
+  uint8_t value[256];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, visits->store->get(entry.name, value, entry.size));
+  if (entry.value) {
+    visits->valuesMatch = visits->valuesMatch && memcmp(value, entry.value, entry.size)==0;
+  }
+  else {
+    // Read in two pieces
+    uint8_t pieces[256];
+    const uint16_t half = entry.size / 2;
+    TEST_ASSERT_EQUAL(PS_SUCCESS, visits->store->readValue(entry, 0, pieces, half));
+    TEST_ASSERT_EQUAL(PS_SUCCESS, visits->store->readValue(entry, half, pieces + half, entry.size - half));
+    TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, visits->store->readValue(entry, half, pieces, entry.size - half + 1));
+    visits->valuesMatch = visits->valuesMatch && memcmp(value, pieces, entry.size)==0;
+  }
+  return visits->count<visits->limit;
+}
+
+void test_for_each(void) {
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  for (unsigned di = 0; di<ELEMENTS(data); di += 2) {
+    TEST_ASSERT_TRUE(data[di]->randomize()->store(paramStore)); // Leave free space between entries
+  }
+  uint8_t big[100];
+  memset(big, 0x5A, sizeof(big));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("big", big, sizeof(big)));
+
+  uint8_t scratch[16];
+  Visits visits = { 0, 1000, true, &paramStore };
+  TEST_ASSERT_EQUAL(ELEMENTS(data) + 1, paramStore.forEach(visitEntry, &visits, scratch, sizeof(scratch)));
+  TEST_ASSERT_EQUAL(ELEMENTS(data) + 1, visits.count);
+  TEST_ASSERT_TRUE_MESSAGE(visits.valuesMatch, "Visited values match get()");
+
+  // Visitor can stop the walk
+  Visits first = { 0, 3, true, &paramStore };
+  TEST_ASSERT_EQUAL(3, paramStore.forEach(visitEntry, &first));
+}
+
+struct Calibration {
+  int16_t offset;
+  uint8_t gain;
+  float scale;
+};
+
+void test_typed_values(void) {
+  const Calibration calibration = { -12, 3, 1.5f };
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(PS_KEY("calib"), calibration));
+  Calibration readBack;
+  memset(&readBack, 0, sizeof(readBack));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get(PS_KEY("calib"), readBack));
+  TEST_ASSERT_EQUAL(-12, readBack.offset);
+  TEST_ASSERT_EQUAL(3, readBack.gain);
+  TEST_ASSERT_TRUE(1.5f==readBack.scale);
+
+  // Integers are stored big endian, those narrower than 32 bits as 4 bytes
+  const uint16_t port = 0x1234;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("port", port));
+  uint8_t raw[4];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("port", raw, sizeof(raw)));
+  TEST_ASSERT_EQUAL(0x00, raw[0]);
+  TEST_ASSERT_EQUAL(0x00, raw[1]);
+  TEST_ASSERT_EQUAL(0x12, raw[2]);
+  TEST_ASSERT_EQUAL(0x34, raw[3]);
+  uint32_t wide = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("port", &wide));
+  TEST_ASSERT_EQUAL(0x1234, wide);
+  int16_t narrow = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("port", narrow));
+  TEST_ASSERT_EQUAL(0x1234, narrow);
+
+  const uint8_t level = 200;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("level", level));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("level", &wide));
+  TEST_ASSERT_EQUAL(200, wide);
+  const bool enabled = true;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("enabled", enabled));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("enabled", &wide));
+  TEST_ASSERT_EQUAL(1, wide);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("enabled", (uint32_t)0));
+  bool enabledBack = true;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("enabled", enabledBack));
+  TEST_ASSERT_FALSE(enabledBack);
+
+  const int64_t big = -0x123456789LL;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("big", big));
+  int64_t bigBack = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("big", bigBack));
+  TEST_ASSERT_TRUE(big==bigBack);
+  TEST_ASSERT_EQUAL_MESSAGE(PS_ERROR_NOT_FOUND, paramStore.get("big", &wide), "Other size doesn't match");
+  uint8_t bigRaw[8];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("big", bigRaw));
+  const long long bigLong = big; // Not int64_t's type on every platform, stored the same
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("big", bigLong));
+  uint8_t bigLongRaw[8];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("big", bigLongRaw));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(bigRaw, bigLongRaw, sizeof(bigRaw));
+  TEST_ASSERT_EQUAL(0xFE, bigRaw[3]);
+
+  // Arrays convert each element
+  const uint16_t table[3] = { 1, 0x0203, 0xFFFF };
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("table", table));
+  uint8_t tableRaw[6];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("table", tableRaw));
+  TEST_ASSERT_EQUAL(0x02, tableRaw[2]);
+  uint16_t tableBack[3];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("table", tableBack));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(table, tableBack, sizeof(table));
+
+  // Existing overloads keep their meaning
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("count", 5));
+  uint32_t count = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("count", &count));
+  TEST_ASSERT_EQUAL(5, count);
+
+  static_assert(PS_KEY("calib").hash==hashKey("calib", PS_MAX_KEY_LENGTH), "Hashed at compile time");
+}
+
+constexpr ParameterSlot SchemaSlots[] = {
+  { PS_KEY("volume"), sizeof(uint32_t) },
+  { PS_KEY("calib"), 12 },
+  { PS_KEY("mode"), sizeof(uint32_t) }, // A uint8_t, stored as 4 bytes
+};
+
+void test_schema(void) {
+  TestStore<STORE_SIZE> byteStore;
+  FixedParameterSchema<ELEMENTS(SchemaSlots)> schema(SchemaSlots);
+  FixedKeyIndex<32> index;
+  FixedFreeSpaceMap<16> freeMap;
+  ParameterStore paramStore(byteStore, &index, &freeMap, &schema);
+  byteStore.resetStore();
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store with schema");
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  // Reads go straight to the slot, however many entries there are
+  uint32_t reads = byteStore.getReadCount();
+  uint32_t volume = 0;
+  TEST_ASSERT_EQUAL_MESSAGE(PS_ERROR_NOT_FOUND, paramStore.get("volume", &volume), "Not set yet");
+  TEST_ASSERT_TRUE_MESSAGE(byteStore.getReadCount() - reads<=2, "Unset slot checked without a walk");
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", 7));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", 8));
+  reads = byteStore.getReadCount();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("volume", &volume));
+  TEST_ASSERT_EQUAL(8, volume);
+  TEST_ASSERT_TRUE_MESSAGE(byteStore.getReadCount() - reads<=3, "Slot read without a walk");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Other keys use the entry chain");
+  }
+
+  // Another size goes in the chain, and the slot takes the key back after
+  const uint8_t shortVolume[2] = { 1, 2 };
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", shortVolume, sizeof(shortVolume)));
+  uint8_t readShort[2] = { 0, 0 };
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("volume", readShort, sizeof(readShort)));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(shortVolume, readShort, sizeof(shortVolume));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("volume", &volume));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", 9));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("volume", readShort, sizeof(readShort)));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("volume", &volume));
+  TEST_ASSERT_EQUAL(9, volume);
+
+  // Transactions write schema keys to the chain like any other
+  const uint8_t mode = 3;
+  TEST_ASSERT_TRUE(paramStore.beginTransaction());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("mode", mode));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", 10));
+  TEST_ASSERT_TRUE(paramStore.commit());
+  uint8_t readMode = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("mode", readMode));
+  TEST_ASSERT_EQUAL(mode, readMode);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("volume", &volume));
+  TEST_ASSERT_EQUAL(10, volume);
+  TEST_ASSERT_TRUE(paramStore.compact());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("volume", 11));
+
+  // Reopened with the schema, and without it
+  ParameterStore reopened(byteStore, NULL, NULL, &schema);
+  TEST_ASSERT_TRUE(reopened.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.get("volume", &volume));
+  TEST_ASSERT_EQUAL(11, volume);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.get("mode", readMode));
+  TEST_ASSERT_EQUAL(mode, readMode);
+  ParameterStore plain(byteStore);
+  TEST_ASSERT_TRUE(plain.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, plain.get("volume", &volume));
+  TEST_ASSERT_EQUAL(11, volume);
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE(data[di]->check(plain));
+  }
+
+  // Fail at every byte of a slot write. The old or the new value is readable.
+  TestStore<STORE_SIZE> presetStore = byteStore;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.set("volume", 12));
+  const uint32_t bytesWritten = byteStore.getBytesWritten() - presetStore.getBytesWritten();
+  bool written = false;
+  for (uint32_t failAt = 1; failAt<bytesWritten; ++failAt) {
+    TestStore<STORE_SIZE> testStore = presetStore;
+    ParameterStore failStore(testStore, NULL, NULL, &schema);
+    TEST_ASSERT_TRUE(failStore.begin());
+    testStore.setFailAfterWritingBytes(failAt);
+    failStore.set("volume", 12);
+
+    testStore.setFailAfterWritingBytes(0);
+    ParameterStore recoverStore(testStore, NULL, NULL, &schema);
+    TEST_ASSERT_TRUE_MESSAGE(recoverStore.begin(), "Began recoverStore");
+    TEST_ASSERT_EQUAL(PS_SUCCESS, recoverStore.get("volume", &volume));
+    TEST_ASSERT_TRUE_MESSAGE(volume==11 || volume==12, "Old or new value");
+    if (written) {
+      TEST_ASSERT_EQUAL_MESSAGE(12, volume, "Stays written once written");
+    }
+    written = (volume==12);
+    ParameterStore plainStore(testStore);
+    TEST_ASSERT_TRUE(plainStore.begin());
+    TEST_ASSERT_EQUAL(PS_SUCCESS, plainStore.get("volume", &volume));
+    TEST_ASSERT_EQUAL_MESSAGE(written ? 12 : 11, volume, "Only one live copy");
+  }
+  TEST_ASSERT_TRUE(written);
+
+  // A store made without the schema keeps its keys in the chain
+  TestStore<STORE_SIZE> oldStore;
+  oldStore.resetStore();
+  ParameterStore before(oldStore);
+  TEST_ASSERT_TRUE(before.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, before.set("volume", 5));
+  ParameterStore after(oldStore, NULL, NULL, &schema);
+  TEST_ASSERT_TRUE(after.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, after.get("volume", &volume));
+  TEST_ASSERT_EQUAL(5, volume);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, after.set("volume", 6));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, after.get("volume", &volume));
+  TEST_ASSERT_EQUAL(6, volume);
+
+  // Every slot of a larger schema is found through its bucket
+  static const char *names[] = { "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7", "k8", "k9", "k10", "k11" };
+  const ParameterSlot manySlots[] = {
+    { names[0], 4 }, { names[1], 4 }, { names[2], 4 }, { names[3], 4 }, { names[4], 4 }, { names[5], 4 },
+    { names[6], 4 }, { names[7], 4 }, { names[8], 4 }, { names[9], 4 }, { names[10], 4 }, { names[11], 4 },
+  };
+  FixedParameterSchema<ELEMENTS(manySlots)> many(manySlots);
+  for (unsigned i=0; i<ELEMENTS(names); ++i) {
+    TEST_ASSERT_EQUAL(i, many.find(ParameterKey(names[i])));
+  }
+  TEST_ASSERT_EQUAL(many.count(), many.find(ParameterKey("k12")));
+  TEST_ASSERT_EQUAL(schema.count(), schema.find(ParameterKey("k0")));
+}
+
+struct Offsets {
+  const char *name;
+  ps_offset_t offset;
+};
+
+static bool findOffset(void *context, const ParameterEntry &entry) {
+  if (strcmp(entry.name, ((Offsets *)context)->name)==0) {
+    ((Offsets *)context)->offset = entry.offset;
+    return false;
+  }
+  return true;
+}
+
+// Distinct offsets used by sets of one key, which rotating allocation spreads over the store
+static int countWriteOffsets(ParameterStore &paramStore, const int sets) {
+  ps_offset_t seen[200];
+  int distinct = 0;
+  for (int i=0; i<sets && i<(int)ELEMENTS(seen); ++i) {
+    TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)i));
+    Offsets found = { "counter", 0 };
+    paramStore.forEach(findOffset, &found);
+    bool known = false;
+    for (int j=0; j<distinct; ++j) {
+      known = known || seen[j]==found.offset;
+    }
+    if (!known) {
+      seen[distinct++] = found.offset;
+    }
+  }
+  return distinct;
+}
+
+void test_rotating_allocation(void) {
+  TestStore<STORE_SIZE> byteStore;
+  ParameterStore paramStore(byteStore);
+  byteStore.resetStore();
+  TEST_ASSERT_TRUE(paramStore.begin());
+  Datum *data[10];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  TEST_ASSERT_TRUE_MESSAGE(countWriteOffsets(paramStore, 100)<=3, "Best fit reuses the same few blocks");
+
+  paramStore.setAllocation(AllocateRotating);
+  const int distinct = countWriteOffsets(paramStore, 200);
+  TEST_ASSERT_TRUE_MESSAGE(distinct>=STORE_SIZE / 2 / 24, "Rotating writes cover the store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE(data[di]->check(paramStore));
+  }
+  for (int i=0; i<CYCLES; ++i) {
+    Datum *d = data[rand() % ELEMENTS(data)];
+    TEST_ASSERT_TRUE(d->randomize()->store(paramStore));
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE(data[di]->check(paramStore));
+    }
+  }
+
+  // The same with the free space map, and resuming after begin()
+  FixedFreeSpaceMap<32> freeMap;
+  FixedKeyIndex<32> index;
+  ParameterStore mapped(byteStore, &index, &freeMap);
+  mapped.setAllocation(AllocateRotating);
+  TEST_ASSERT_TRUE(mapped.begin());
+  TEST_ASSERT_TRUE_MESSAGE(countWriteOffsets(mapped, 200)>=STORE_SIZE / 2 / 24, "Rotating writes cover the store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE(data[di]->check(mapped));
+  }
+}
+
+typedef RamFlash<16384, 2048> TestFlash;
+
+// Flash that loses power after a number of programmed bytes
+class FailingFlash : public TestFlash {
+  uint32_t _budget;
+public:
+  FailingFlash(const TestFlash &flash, const uint32_t budget)
+    : TestFlash(flash), _budget(budget) {
+  }
+  void restorePower() { _budget = 0xFFFFFFFF; }
+  virtual void program(uint32_t offset, const void *bytes, uint16_t size) {
+    const uint16_t done = MIN((uint32_t)size, _budget) / writeGranularity() * writeGranularity();
+    if (done>0) {
+      TestFlash::program(offset, bytes, done);
+    }
+    _budget -= MIN((uint32_t)size, _budget);
+  }
+  virtual void erase(uint32_t block) {
+    if (_budget>0) {
+      TestFlash::erase(block);
+    }
+  }
+};
+
+void test_flash_log_store(void) {
+  TestFlash flash;
+  Datum *data[20];
+  uint32_t sets = 0;
+  {
+    FixedFlashLogStore<STORE_SIZE> store(flash);
+    ParameterStore paramStore(store);
+    TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store on blank flash");
+    makeTestEntries(paramStore, data, ELEMENTS(data));
+    for (int i=0; i<CYCLES; ++i, ++sets) {
+      Datum *d = data[rand() % ELEMENTS(data)];
+      TEST_ASSERT_TRUE(d->randomize()->store(paramStore));
+      for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+        TEST_ASSERT_TRUE(data[di]->check(paramStore));
+      }
+    }
+    TEST_ASSERT_TRUE_MESSAGE(store.erases()<sets / 2, "Far fewer erases than sets");
+  }
+  uint32_t least = flash.eraseCount(0), most = least;
+  for (uint32_t block=1; block<flash.size() / flash.eraseBlockSize(); ++block) {
+    least = MIN(least, flash.eraseCount(block));
+    most = MAX(most, flash.eraseCount(block));
+  }
+  TEST_ASSERT_TRUE_MESSAGE(most>0 && most - least<=1, "Erases spread over the blocks");
+
+  // Cut power at every programmed granule of a run of sets that reclaims a block
+  FixedFlashLogStore<STORE_SIZE> store(flash);
+  ParameterStore paramStore(store);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Reopened store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE(data[di]->check(paramStore));
+  }
+  const uint32_t before = store.erases();
+  const uint32_t counts = 30;
+  FailingFlash counting(flash, 0xFFFFFFFF);
+  {
+    FixedFlashLogStore<STORE_SIZE> countingStore(counting);
+    ParameterStore countingParams(countingStore);
+    TEST_ASSERT_TRUE(countingParams.begin());
+    for (uint32_t v=1; v<=counts; ++v) {
+      TEST_ASSERT_EQUAL(PS_SUCCESS, countingParams.set("counter", v));
+    }
+    TEST_ASSERT_TRUE_MESSAGE(countingStore.erases()>before, "Run of sets reclaims a block");
+  }
+  uint32_t last = 0;
+  for (uint32_t failAt = 4; failAt<0xFFFFFFFF; failAt += 4) {
+    FailingFlash failing(flash, failAt);
+    {
+      FixedFlashLogStore<STORE_SIZE> failStore(failing);
+      ParameterStore failParams(failStore);
+      TEST_ASSERT_TRUE(failParams.begin());
+      for (uint32_t v=1; v<=counts; ++v) {
+        failParams.set("counter", v);
+      }
+    }
+    failing.restorePower();
+    FixedFlashLogStore<STORE_SIZE> recoverStore(failing);
+    ParameterStore recoverParams(recoverStore);
+    TEST_ASSERT_TRUE_MESSAGE(recoverParams.begin(), "Began after power failure");
+    uint32_t counter = 0;
+    const int found = recoverParams.get("counter", &counter);
+    TEST_ASSERT_TRUE_MESSAGE(found==PS_SUCCESS || (found==PS_ERROR_NOT_FOUND && last==0), "Counter lost");
+    TEST_ASSERT_TRUE_MESSAGE(counter>=last, "Counter went back");
+    last = counter;
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE_MESSAGE(data[di]->check(recoverParams), "Other values survive power failure");
+    }
+    if (counter==counts) {
+      break;
+    }
+  }
+  TEST_ASSERT_EQUAL(counts, last);
+}
+
+// Old or new value of key after power fails during each byte of a set() that overwrites it
+static void checkInterruptedUpdate(TestStore<STORE_SIZE> &byteStore, Datum **data, const unsigned count,
+                                   const char *key, const uint8_t *oldValue, const uint8_t *newValue, const uint16_t size) {
+  TestStore<STORE_SIZE> measureStore = byteStore;
+  ParameterStore measure(measureStore);
+  TEST_ASSERT_TRUE(measure.begin());
+  const uint32_t before = measureStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, measure.set(key, newValue, size));
+  const uint32_t total = measureStore.getBytesWritten() - before;
+  for (uint32_t failAt = 1; failAt<total; ++failAt) {
+    TestStore<STORE_SIZE> failStore = byteStore;
+    ParameterStore failing(failStore);
+    TEST_ASSERT_TRUE(failing.begin());
+    failStore.setFailAfterWritingBytes(failAt);
+    failing.set(key, newValue, size);
+    failStore.setFailAfterWritingBytes(0);
+    ParameterStore recovered(failStore);
+    TEST_ASSERT_TRUE(recovered.begin());
+    uint8_t value[32];
+    TEST_ASSERT_EQUAL(PS_SUCCESS, recovered.get(key, value, size));
+    TEST_ASSERT_TRUE_MESSAGE(memcmp(value, oldValue, size)==0 || memcmp(value, newValue, size)==0, "Old or new value after interrupted update");
+    for (unsigned di = 0; di<count; ++di) {
+      TEST_ASSERT_TRUE(data[di]->check(recovered));
+    }
+  }
+}
+
+void test_in_place_update(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE(paramStore.begin());
+  Datum *data[10];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)1));
+  Offsets before = { "counter", 0 };
+  paramStore.forEach(findOffset, &before);
+  uint32_t written = byteStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)2));
+  const uint32_t inPlace = byteStore.getBytesWritten() - written;
+  Offsets after = { "counter", 0 };
+  paramStore.forEach(findOffset, &after);
+  TEST_ASSERT_EQUAL_MESSAGE(before.offset, after.offset, "Same size value overwritten in place");
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("counter", value));
+  TEST_ASSERT_EQUAL(2, value);
+
+  // Setting the stored value again writes nothing
+  written = byteStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)2));
+  TEST_ASSERT_EQUAL(written, byteStore.getBytesWritten());
+  // Unless the stored value has been damaged since
+  const uint8_t damage = 0xFF;
+  byteStore.write(after.offset + 12 /* entry header */, &damage, sizeof(damage));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)2));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("counter", value));
+  TEST_ASSERT_EQUAL_MESSAGE(2, value, "Set repairs damaged value");
+
+  // A new entry costs more
+  paramStore.setAllocation(AllocateRotating);
+  written = byteStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("counter", (uint32_t)3));
+  TEST_ASSERT_TRUE_MESSAGE(inPlace<(byteStore.getBytesWritten() - written), "In place writes less than a new entry");
+  paramStore.forEach(findOffset, &after);
+  TEST_ASSERT_TRUE_MESSAGE(before.offset!=after.offset, "Rotating allocation still moves the value");
+  paramStore.setAllocation(AllocateBestFit);
+
+  // Power failure leaves the old or new value. Small values are saved in the plan, larger
+  // ones in free space.
+  const uint8_t oldCount[] = { 0, 0, 0, 3 };
+  const uint8_t newCount[] = { 0, 0, 1, 0 };
+  checkInterruptedUpdate(byteStore, data, ELEMENTS(data), "counter", oldCount, newCount, sizeof(newCount));
+  uint8_t oldBlob[12];
+  uint8_t newBlob[12];
+  for (unsigned i=0; i<sizeof(oldBlob); ++i) {
+    oldBlob[i] = i;
+    newBlob[i] = 100 + i;
+  }
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("blob", oldBlob, sizeof(oldBlob)));
+  checkInterruptedUpdate(byteStore, data, ELEMENTS(data), "blob", oldBlob, newBlob, sizeof(newBlob));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("blob", newBlob, sizeof(newBlob)));
+  Offsets blob = { "blob", 0 };
+  paramStore.forEach(findOffset, &blob);
+  uint8_t bigBlob[PS_UPDATE_IN_PLACE_BYTES + 4];
+  memset(bigBlob, 1, sizeof(bigBlob));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("blob", bigBlob, sizeof(bigBlob)));
+  Offsets moved = { "blob", 0 };
+  paramStore.forEach(findOffset, &moved);
+  memset(bigBlob, 2, sizeof(bigBlob));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("blob", bigBlob, sizeof(bigBlob)));
+  paramStore.forEach(findOffset, &blob);
+  TEST_ASSERT_TRUE_MESSAGE(blob.offset!=moved.offset, "Larger values are written afresh");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE(data[di]->check(paramStore));
+  }
+}
+
+void test_indexed_lookup(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  FixedKeyIndex<64> index;
+  ParameterStore paramStore(byteStore, &index);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began indexed store");
+
+  Datum *data[40];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  TEST_ASSERT_EQUAL(ELEMENTS(data), index.count());
+
+  for (int i=0; i<CYCLES; ++i) {
+    Datum *d = data[rand() % ELEMENTS(data)];
+    d->randomize();
+    TEST_ASSERT_TRUE_MESSAGE(d->store(paramStore), "Stored new value successfully");
+    uint32_t reads = byteStore.getReadCount();
+    TEST_ASSERT_TRUE_MESSAGE(d->check(paramStore), "Check value just stored");
+    TEST_ASSERT_TRUE_MESSAGE((byteStore.getReadCount() - reads)<=(2 + NAME_READS), "Indexed get reads entry and value only");
+  }
+  TEST_ASSERT_EQUAL(ELEMENTS(data), index.count());
+
+  // Index is rebuilt on begin()
+  FixedKeyIndex<64> reopenedIndex;
+  ParameterStore reopened(byteStore, &reopenedIndex);
+  TEST_ASSERT_TRUE_MESSAGE(reopened.begin(), "Began reopened store");
+  TEST_ASSERT_EQUAL(ELEMENTS(data), reopenedIndex.count());
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(reopened), "Read value through rebuilt index");
+  }
+
+  // An index too small for the store falls back to walking
+  FixedKeyIndex<8> smallIndex;
+  ParameterStore fallback(byteStore, &smallIndex);
+  TEST_ASSERT_TRUE_MESSAGE(fallback.begin(), "Began fallback store");
+  TEST_ASSERT_FALSE(smallIndex.isValid());
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(fallback), "Read value with overflowed index");
+  }
+}
+
+static ps_offset_t indexLookup(const KeyIndex &index, const uint32_t hash) {
+  uint16_t pos = index.start(hash);
+  return index.probe(hash, &pos);
+}
+
+// Hashes below 0x10000 fold to themselves, so these land in chosen slots of 8
+void test_key_index_remove(void) {
+  FixedKeyIndex<8> index;
+  index.clear();
+  const uint32_t hashes[] = { 6, 14, 22, 7, 5 }; // Homes 6, 6, 6, 7, 5
+  const ps_offset_t offsets[] = { 10, 20, 30, 40, 50 };
+  for (unsigned i=0; i<ELEMENTS(hashes); ++i) {
+    TEST_ASSERT_TRUE(index.insert(hashes[i], offsets[i]));
+  }
+  // The run from slot 5 wraps to slot 1: 50, 10, 20, 30, 40
+
+  // Removing from the middle pulls the rest of the run back, across the wrap
+  TEST_ASSERT_TRUE(index.remove(14, 20));
+  TEST_ASSERT_EQUAL(4, index.count());
+  TEST_ASSERT_EQUAL(0, indexLookup(index, 14));
+  TEST_ASSERT_EQUAL(10, indexLookup(index, 6));
+  TEST_ASSERT_EQUAL(30, indexLookup(index, 22));
+  TEST_ASSERT_EQUAL(40, indexLookup(index, 7));
+  TEST_ASSERT_EQUAL(50, indexLookup(index, 5));
+
+  // A member past the wrap, and one that stays at its home
+  TEST_ASSERT_TRUE(index.remove(22, 30));
+  TEST_ASSERT_EQUAL(10, indexLookup(index, 6));
+  TEST_ASSERT_EQUAL(40, indexLookup(index, 7));
+  TEST_ASSERT_TRUE(index.remove(5, 50));
+  TEST_ASSERT_EQUAL(10, indexLookup(index, 6));
+  TEST_ASSERT_EQUAL(40, indexLookup(index, 7));
+  TEST_ASSERT_FALSE_MESSAGE(index.remove(5, 50), "Already removed");
+  TEST_ASSERT_EQUAL(2, index.count());
+
+  // Freed slots are reused
+  TEST_ASSERT_TRUE(index.insert(14, 60));
+  TEST_ASSERT_EQUAL(60, indexLookup(index, 14));
+  TEST_ASSERT_EQUAL(10, indexLookup(index, 6));
+}
+
+void test_free_space_map(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  FixedFreeSpaceMap<32> freeMap;
+  ParameterStore paramStore(byteStore, NULL, &freeMap);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began mapped store");
+
+  // Leave a large hole followed by a small one, then write a value that fits either.
+  uint8_t bytes[64];
+  memset(bytes, 0x5A, sizeof(bytes));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("large", bytes, 64));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("sep1", bytes, 4));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("small", bytes, 8));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("sep2", bytes, 4));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("small", bytes, 4));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("large", bytes, 12));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("fits", bytes, 8));
+
+  // Best fit takes the small hole, leaving the large one intact.
+  bool sawLargeHole = false;
+  for (uint16_t i=0; i<freeMap.count(); ++i) {
+    sawLargeHole = sawLargeHole || freeMap.extent(i).size==(12 + 64 + NAME_BYTES("large") + 4);
+  }
+  TEST_ASSERT_TRUE_MESSAGE(sawLargeHole, "Large hole left for large values");
+
+  // Map maintained by set() matches one rebuilt by begin()
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  for (int i=0; i<CYCLES; ++i) {
+    Datum *d = data[rand() % ELEMENTS(data)];
+    d->randomize();
+    TEST_ASSERT_TRUE_MESSAGE(d->store(paramStore), "Stored new value successfully");
+  }
+  FixedFreeSpaceMap<32> rebuilt;
+  ParameterStore reopened(byteStore, NULL, &rebuilt);
+  TEST_ASSERT_TRUE_MESSAGE(reopened.begin(), "Began reopened store");
+  TEST_ASSERT_TRUE(freeMap.isValid() && rebuilt.isValid());
+  TEST_ASSERT_EQUAL(rebuilt.count(), freeMap.count());
+  for (uint16_t i=0; i<freeMap.count(); ++i) {
+    TEST_ASSERT_EQUAL(rebuilt.extent(i).offset, freeMap.extent(i).offset);
+    TEST_ASSERT_EQUAL(rebuilt.extent(i).size, freeMap.extent(i).size);
+  }
+
+  // The extent before a freed entry is found by offset, whatever the sizes
+  FixedFreeSpaceMap<8> neighbours;
+  neighbours.clear();
+  TEST_ASSERT_TRUE(neighbours.add(200, 40));
+  TEST_ASSERT_TRUE(neighbours.add(100, 16));
+  TEST_ASSERT_TRUE(neighbours.add(300, 8));
+  ps_offset_t start = 0;
+  uint16_t size = 0;
+  TEST_ASSERT_TRUE(neighbours.findEndingAt(240, &start, &size));
+  TEST_ASSERT_EQUAL(200, start);
+  TEST_ASSERT_EQUAL(40, size);
+  TEST_ASSERT_TRUE(neighbours.findEndingAt(116, &start, &size));
+  TEST_ASSERT_EQUAL(100, start);
+  TEST_ASSERT_FALSE(neighbours.findEndingAt(300, &start, &size));
+  TEST_ASSERT_FALSE(neighbours.findEndingAt(100, &start, &size));
+  TEST_ASSERT_TRUE(neighbours.remove(200, 40));
+  TEST_ASSERT_FALSE(neighbours.findEndingAt(240, &start, &size));
+  TEST_ASSERT_TRUE(neighbours.findEndingAt(308, &start, &size));
+  TEST_ASSERT_EQUAL(300, start);
+}
+
+uint16_t freeExtents(TestStore<STORE_SIZE> &byteStore) {
+  FixedFreeSpaceMap<64> freeMap;
+  ParameterStore reopened(byteStore, NULL, &freeMap);
+  TEST_ASSERT_TRUE_MESSAGE(reopened.begin(), "Began reopened store");
+  TEST_ASSERT_TRUE(freeMap.isValid());
+  return freeMap.count();
+}
+
+void fragment(ParameterStore &paramStore, Datum **data, int countData) {
+  makeTestEntries(paramStore, data, countData);
+  for (int i=0; i<CYCLES; ++i) {
+    int di = rand() % countData;
+    Datum *d = data[di];
+    if (rand() % 2) {
+      // Change size as well as value
+      Datum *last = d;
+      data[di] = d = DatumBytes::make(last->name());
+      delete last;
+    }
+    d->randomize();
+    TEST_ASSERT_TRUE_MESSAGE(d->store(paramStore), "Stored new value successfully");
+  }
+}
+
+void compactInSteps(KeyIndex *index, FreeSpaceMap *freeMap) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore, index, freeMap);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+  Datum *data[20];
+  fragment(paramStore, data, ELEMENTS(data));
+
+  int steps = 0;
+  while (!paramStore.compact(64)) {
+    ++steps;
+    TEST_ASSERT_TRUE_MESSAGE(steps<1000, "Compaction finishes");
+    if (steps<10) {
+      // Sets interleave with compaction steps
+      Datum *d = data[rand() % ELEMENTS(data)];
+      d->randomize();
+      TEST_ASSERT_TRUE_MESSAGE(d->store(paramStore), "Stored new value successfully");
+    }
+  }
+  TEST_ASSERT_TRUE_MESSAGE(steps>1, "Budget spreads compaction over several calls");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value after compaction");
+  }
+  TEST_ASSERT_EQUAL(1, freeExtents(byteStore));
+}
+
+void test_compact(void) {
+  compactInSteps(NULL, NULL);
+}
+
+void test_compact_mapped(void) {
+  FixedKeyIndex<32> index;
+  FixedFreeSpaceMap<32> freeMap;
+  compactInSteps(&index, &freeMap);
+}
+
+void test_compact_with_error(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+  Datum *data[20];
+  fragment(paramStore, data, ELEMENTS(data));
+
+  TestStore<STORE_SIZE> precompactStore = byteStore;
+  TEST_ASSERT_TRUE(paramStore.compact());
+  const uint32_t bytesWritten = byteStore.getBytesWritten() - precompactStore.getBytesWritten();
+
+  // Fail at every byte. Every value must survive, and compaction must be able to finish.
+  for (uint32_t i = 1; i<bytesWritten; ++i) {
+    TestStore<STORE_SIZE> testStore = precompactStore;
+    ParameterStore failStore(testStore);
+    TEST_ASSERT_TRUE_MESSAGE(failStore.begin(), "Began failStore");
+    testStore.setFailAfterWritingBytes(i);
+    failStore.compact();
+
+    testStore.setFailAfterWritingBytes(0);
+    ParameterStore recoverStore(testStore);
+    TEST_ASSERT_TRUE_MESSAGE(recoverStore.begin(), "Began recoverStore");
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE_MESSAGE(data[di]->check(recoverStore), "Value survives interrupted compaction");
+    }
+    TEST_ASSERT_TRUE(recoverStore.compact());
+    TEST_ASSERT_EQUAL(1, freeExtents(testStore));
+  }
+}
 
 // void test_led_state_high(void) {
 //     digitalWrite(LED_BUILTIN, HIGH);
@@ -413,6 +1497,684 @@ void test_serialize_deserialize(void) {
 // }
 
 extern "C"
+void test_cached_store(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  CachedStore<64, 4> cache(byteStore);
+  ParameterStore paramStore(cache);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began cached store");
+
+  Datum *data[40];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  cache.resetCounters();
+  const uint32_t reads = byteStore.getReadCount();
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value through cache");
+  }
+  TEST_ASSERT_TRUE_MESSAGE(cache.hits()>cache.misses(), "Walks are mostly served from cache");
+  TEST_ASSERT_EQUAL(cache.misses(), byteStore.getReadCount() - reads);
+
+  // Writes go through to the backing store and keep cached pages current
+  for (int i=0; i<CYCLES; ++i) {
+    Datum *d = data[rand() % ELEMENTS(data)];
+    d->randomize();
+    TEST_ASSERT_TRUE_MESSAGE(d->store(paramStore), "Stored new value through cache");
+    TEST_ASSERT_TRUE_MESSAGE(d->check(paramStore), "Read new value through cache");
+  }
+  ParameterStore direct(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(direct.begin(), "Began uncached store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(direct), "Read value written through cache");
+  }
+}
+
+void test_write_back_cache(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+  FixedWriteBackCache<4, 8> cache(paramStore, 12, 100);
+
+  // Repeated sets stay in RAM until the interval passes
+  const uint32_t written = byteStore.getBytesWritten();
+  for (uint32_t v=1; v<=50; ++v) {
+    TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("counter", v));
+  }
+  TEST_ASSERT_EQUAL_MESSAGE(written, byteStore.getBytesWritten(), "Sets held in RAM");
+  TEST_ASSERT_EQUAL(49, cache.folds());
+  TEST_ASSERT_EQUAL(4, cache.dirtyBytes());
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.get("counter", value));
+  TEST_ASSERT_EQUAL(50, value);
+  TEST_ASSERT_EQUAL_MESSAGE(PS_ERROR_NOT_FOUND, paramStore.get("counter", value), "Not yet in store");
+  uint16_t narrow = 0;
+  TEST_ASSERT_EQUAL_MESSAGE(PS_SUCCESS, cache.get("counter", narrow), "Narrow integers share the 4 byte form");
+  TEST_ASSERT_EQUAL(50, narrow);
+  uint64_t wrongSize = 0;
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, cache.get("counter", wrongSize));
+  TEST_ASSERT_TRUE(cache.poll(99));
+  TEST_ASSERT_EQUAL(4, cache.dirtyBytes());
+  TEST_ASSERT_TRUE(cache.poll(100));
+  TEST_ASSERT_EQUAL(0, cache.dirtyBytes());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("counter", value));
+  TEST_ASSERT_EQUAL_MESSAGE(50, value, "Interval flushes folded value");
+
+  // Setting the stored value again writes nothing
+  const uint32_t flushed = byteStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("counter", (uint32_t)50));
+  TEST_ASSERT_EQUAL(0, cache.dirtyBytes());
+  TEST_ASSERT_EQUAL(flushed, byteStore.getBytesWritten());
+
+  // Crossing the dirty byte threshold flushes
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("a", (uint32_t)1));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("b", (uint32_t)2));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("c", (uint32_t)3));
+  TEST_ASSERT_EQUAL(12, cache.dirtyBytes());
+  TEST_ASSERT_EQUAL(flushed, byteStore.getBytesWritten());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("counter", (uint32_t)51));
+  TEST_ASSERT_EQUAL(0, cache.dirtyBytes());
+  const char *keys[] = { "a", "b", "c", "counter" };
+  const uint32_t expect[] = { 1, 2, 3, 51 };
+  for (unsigned i=0; i<ELEMENTS(keys); ++i) {
+    TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get(keys[i], value));
+    TEST_ASSERT_EQUAL(expect[i], value);
+  }
+
+  // Values over ValueBytes go straight through, replacing any cached value
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("counter", (uint32_t)52));
+  uint8_t big[20];
+  memset(big, 7, sizeof(big));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("counter", big, sizeof(big)));
+  TEST_ASSERT_EQUAL(0, cache.dirtyBytes());
+  uint8_t back[20];
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.get("counter", back, sizeof(back)));
+  TEST_ASSERT_EQUAL_MEMORY(big, back, sizeof(back));
+
+  // More keys than lines: dirty lines are flushed to make room, and reads are cached
+  for (uint32_t i=0; i<10; ++i) {
+    char name[8];
+    sprintf(name, "k%u", (unsigned)i);
+    TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set(name, i));
+  }
+  for (uint32_t i=0; i<10; ++i) {
+    char name[8];
+    sprintf(name, "k%u", (unsigned)i);
+    TEST_ASSERT_EQUAL(PS_SUCCESS, cache.get(name, value));
+    TEST_ASSERT_EQUAL(i, value);
+  }
+
+  // Unflushed values are lost with power
+  TEST_ASSERT_TRUE(cache.flush());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("k1", (uint32_t)100));
+  ParameterStore reopened(byteStore);
+  TEST_ASSERT_TRUE(reopened.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.get("k1", value));
+  TEST_ASSERT_EQUAL_MESSAGE(1, value, "Only flushed value survives");
+
+  // A threshold of 0 writes every set through
+  cache.setFlushThreshold(0);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, cache.set("k2", (uint32_t)200));
+  TEST_ASSERT_EQUAL(0, cache.dirtyBytes());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("k2", value));
+  TEST_ASSERT_EQUAL(200, value);
+
+  // In a full store, a cached set() still succeeds and keeps its value for flush()
+  TestStore<200> smallStore;
+  smallStore.resetStore();
+  ParameterStore small(smallStore);
+  TEST_ASSERT_TRUE(small.begin());
+  char name[8];
+  for (uint32_t i=0; ; ++i) {
+    sprintf(name, "f%u", (unsigned)i);
+    if (small.set(name, i)!=PS_SUCCESS) {
+      break;
+    }
+  }
+  FixedWriteBackCache<4, 8> full(small, 4, 100);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, full.set("x", (uint32_t)1));
+  TEST_ASSERT_EQUAL_MESSAGE(PS_SUCCESS, full.set("y", (uint32_t)2), "Accepted though write-back failed");
+  TEST_ASSERT_EQUAL(8, full.dirtyBytes());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, full.get("y", value));
+  TEST_ASSERT_EQUAL(2, value);
+  TEST_ASSERT_FALSE(full.flush());
+
+  // An oversized value that doesn't fit leaves the dirty value it would replace
+  TEST_ASSERT_EQUAL(PS_INSUFFICIENT_SPACE, full.set("x", big, sizeof(big)));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, full.get("x", value));
+  TEST_ASSERT_EQUAL(1, value);
+  TEST_ASSERT_EQUAL(8, full.dirtyBytes());
+}
+
+void test_vectored_io(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  CachedStore<16, 2> cache(byteStore);
+  TEST_ASSERT_TRUE(cache.begin());
+
+  uint8_t head[3] = { 1, 2, 3 };
+  uint8_t body[20];
+  for (unsigned i=0; i<sizeof(body); ++i) {
+    body[i] = 10 + i;
+  }
+  uint32_t tail = 0xDEADBEEF;
+  StoreSpan out[] = { { head, sizeof(head) }, { body, sizeof(body) }, { &tail, sizeof(tail) } };
+  uint8_t before[sizeof(head) + sizeof(body) + sizeof(tail)];
+  cache.read(40, before, sizeof(before)); // Pull pages into cache so the write must refresh them
+  cache.writev(40, out, ELEMENTS(out));
+
+  uint8_t flat[sizeof(before)];
+  byteStore.read(40, flat, sizeof(flat));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(head, flat, sizeof(head));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(body, flat + sizeof(head), sizeof(body));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY((uint8_t *)&tail, flat + sizeof(head) + sizeof(body), sizeof(tail));
+
+  uint8_t inHead[sizeof(head)], inBody[sizeof(body)];
+  uint32_t inTail = 0;
+  StoreSpan in[] = { { inHead, sizeof(inHead) }, { inBody, sizeof(inBody) }, { &inTail, sizeof(inTail) } };
+  cache.readv(40, in, ELEMENTS(in));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(head, inHead, sizeof(head));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(body, inBody, sizeof(body));
+  TEST_ASSERT_EQUAL_HEX32(tail, inTail);
+}
+
+void transaction(KeyIndex *index, FreeSpaceMap *freeMap) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore, index, freeMap);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  // Aborted changes are never visible
+  TEST_ASSERT_TRUE(paramStore.beginTransaction());
+  TEST_ASSERT_FALSE_MESSAGE(paramStore.beginTransaction(), "Transactions do not nest");
+  Datum *changed = data[3]->clone()->randomize();
+  TEST_ASSERT_TRUE(changed->store(paramStore));
+  paramStore.abort();
+  TEST_ASSERT_TRUE_MESSAGE(data[3]->check(paramStore), "Aborted value not visible");
+  delete changed;
+
+  for (int i=0; i<CYCLES; ++i) {
+    Datum *next[ELEMENTS(data)];
+    memcpy(next, data, sizeof(data));
+    TEST_ASSERT_TRUE_MESSAGE(paramStore.beginTransaction(), "Began transaction");
+    for (int n=0; n<5; ++n) {
+      const int di = rand() % ELEMENTS(data); // May pick the same key twice
+      next[di] = next[di]->clone()->randomize();
+      TEST_ASSERT_TRUE_MESSAGE(next[di]->store(paramStore), "Stored value in transaction");
+      TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Committed value until commit");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(paramStore.commit(), "Committed transaction");
+    memcpy(data, next, sizeof(data));
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE_MESSAGE(data[di]->check(paramStore), "Read value after commit");
+    }
+    if (freeExtents(byteStore)>4) {
+      paramStore.compact();
+    }
+  }
+
+  ParameterStore reopened(byteStore, index, freeMap);
+  TEST_ASSERT_TRUE_MESSAGE(reopened.begin(), "Began reopened store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(reopened), "Read committed value after begin");
+  }
+}
+
+void test_transaction(void) {
+  transaction(NULL, NULL);
+}
+
+void test_transaction_mapped(void) {
+  FixedKeyIndex<32> index;
+  FixedFreeSpaceMap<32> freeMap;
+  transaction(&index, &freeMap);
+}
+
+void test_transaction_with_error(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+
+  Datum *data[20];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  Datum *next[ELEMENTS(data)];
+  memcpy(next, data, sizeof(data));
+  for (unsigned di = 0; di<ELEMENTS(data); di += 3) {
+    next[di] = data[di]->clone()->randomize();
+  }
+  TestStore<STORE_SIZE> pretransactionStore = byteStore;
+  TEST_ASSERT_TRUE(paramStore.beginTransaction());
+  for (unsigned di = 0; di<ELEMENTS(data); di += 3) {
+    TEST_ASSERT_TRUE(next[di]->store(paramStore));
+  }
+  TEST_ASSERT_TRUE(paramStore.commit());
+  const uint32_t bytesWritten = byteStore.getBytesWritten() - pretransactionStore.getBytesWritten();
+
+  // Fail at every byte. Either all new values or all old values are readable.
+  bool committed = false;
+  for (uint32_t failAt = 1; failAt<bytesWritten; ++failAt) {
+    TestStore<STORE_SIZE> testStore = pretransactionStore;
+    ParameterStore failStore(testStore);
+    TEST_ASSERT_TRUE(failStore.begin());
+    testStore.setFailAfterWritingBytes(failAt);
+    failStore.beginTransaction();
+    for (unsigned di = 0; di<ELEMENTS(data); di += 3) {
+      next[di]->store(failStore);
+    }
+    failStore.commit();
+
+    testStore.setFailAfterWritingBytes(0);
+    ParameterStore recoverStore(testStore);
+    TEST_ASSERT_TRUE_MESSAGE(recoverStore.begin(), "Began recoverStore");
+    Datum **expect = next[0]->check(recoverStore) ? next : data;
+    if (committed) {
+      TEST_ASSERT_TRUE_MESSAGE(expect==next, "Stays committed once committed");
+    }
+    committed = (expect==next);
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE_MESSAGE(expect[di]->check(recoverStore), "All or none of the transaction");
+    }
+  }
+  TEST_ASSERT_TRUE_MESSAGE(committed, "Should have finished with transaction committed");
+}
+
+void test_bulk_load(void) {
+  TestStore<STORE_SIZE> byteStore;
+  FixedKeyIndex<32> index;
+  FixedFreeSpaceMap<16> freeMap;
+  ParameterStore paramStore(byteStore, &index, &freeMap);
+  byteStore.resetStore();
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began store");
+
+  Datum *data[12];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+
+  // The load keeps half the keys with new values and adds some others
+  Datum *next[9];
+  for (unsigned di = 0; di<6; ++di) {
+    next[di] = data[di]->clone()->randomize();
+  }
+  for (unsigned di = 6; di<ELEMENTS(next); ++di) {
+    char name[10];
+    sprintf(name, "load%03d", di);
+    next[di] = DatumBytes::make(name);
+  }
+  TestStore<STORE_SIZE> preloadStore = byteStore;
+  TEST_ASSERT_TRUE(paramStore.beginLoad());
+  for (unsigned di = 0; di<ELEMENTS(next); ++di) {
+    TEST_ASSERT_TRUE(next[di]->store(paramStore));
+  }
+  TEST_ASSERT_TRUE_MESSAGE(data[0]->check(paramStore), "Old values readable until commit");
+  TEST_ASSERT_TRUE(paramStore.commit());
+  const uint32_t bytesWritten = byteStore.getBytesWritten() - preloadStore.getBytesWritten();
+  for (unsigned di = 0; di<ELEMENTS(next); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(next[di]->check(paramStore), "Loaded value");
+  }
+  for (unsigned di = 6; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_FALSE_MESSAGE(data[di]->check(paramStore), "Load replaced old values");
+  }
+  TEST_ASSERT_EQUAL(ELEMENTS(next), index.count());
+  TEST_ASSERT_TRUE_MESSAGE(next[6]->store(paramStore), "Store takes sets after a load");
+
+  // Fail at every byte. Either the whole old store or the whole load is readable.
+  bool committed = false;
+  for (uint32_t failAt = 1; failAt<bytesWritten; ++failAt) {
+    TestStore<STORE_SIZE> testStore = preloadStore;
+    ParameterStore failStore(testStore);
+    TEST_ASSERT_TRUE(failStore.begin());
+    testStore.setFailAfterWritingBytes(failAt);
+    failStore.beginLoad();
+    for (unsigned di = 0; di<ELEMENTS(next); ++di) {
+      next[di]->store(failStore);
+    }
+    failStore.commit();
+
+    testStore.setFailAfterWritingBytes(0);
+    ParameterStore recoverStore(testStore);
+    TEST_ASSERT_TRUE_MESSAGE(recoverStore.begin(), "Began recoverStore");
+    const bool loaded = next[0]->check(recoverStore);
+    if (committed) {
+      TEST_ASSERT_TRUE_MESSAGE(loaded, "Stays loaded once loaded");
+    }
+    committed = loaded;
+    for (unsigned di = 0; di<ELEMENTS(next); ++di) {
+      TEST_ASSERT_EQUAL_MESSAGE(loaded, next[di]->check(recoverStore), "All or none of the load");
+    }
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_EQUAL_MESSAGE(!loaded, data[di]->check(recoverStore), "All or none of the old store");
+    }
+  }
+  TEST_ASSERT_TRUE_MESSAGE(committed, "Should have finished with load committed");
+
+  // When old and new can't both fit, deserialize() clears the store first
+  char buffer[1500];
+  const int size = paramStore.serialize(buffer, sizeof(buffer));
+  TEST_ASSERT_TRUE(size>0);
+  Datum *filler[100];
+  int filled = 0;
+  for (; filled<(int)ELEMENTS(filler); ++filled) {
+    char name[10];
+    sprintf(name, "fill%03d", filled);
+    filler[filled] = DatumBytes::make(name);
+    if (!filler[filled]->store(paramStore)) {
+      delete filler[filled];
+      break;
+    }
+  }
+  TEST_ASSERT_TRUE_MESSAGE(filled<(int)ELEMENTS(filler), "Filled the store");
+  FixedDeserializer<16> parser(paramStore);
+  parser.begin();
+  parser.write(buffer, size);
+  TEST_ASSERT_FALSE_MESSAGE(parser.end(), "Load did not fit beside the old store");
+  TEST_ASSERT_TRUE(parser.full());
+  TEST_ASSERT_TRUE_MESSAGE(filler[0]->check(paramStore), "Old store kept after a load that didn't fit");
+  TEST_ASSERT_TRUE_MESSAGE(paramStore.deserialize(buffer, size), "Deserialized into the full store");
+  for (unsigned di = 0; di<ELEMENTS(next); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(next[di]->check(paramStore), "Deserialized value");
+  }
+  TEST_ASSERT_FALSE(filler[0]->check(paramStore));
+}
+
+void test_view(void) {
+  RamStore<STORE_SIZE> ram;
+  ram.resetStore();
+  CachedStore<32, 4> cache(ram);
+  ParameterStore paramStore(cache);
+  TEST_ASSERT_TRUE(paramStore.begin());
+  uint8_t table[40];
+  for (unsigned i=0; i<sizeof(table); ++i) {
+    table[i] = rand() % 256;
+  }
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("table", table, sizeof(table)));
+
+  const uint8_t *value = NULL;
+  uint16_t size = 0;
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.view("table", &value, &size));
+  TEST_ASSERT_EQUAL(sizeof(table), size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(table, value, size);
+  TEST_ASSERT_TRUE_MESSAGE(value>=ram.address(0, 0) && value<ram.address(0, 0) + ram.size(), "Points into the store");
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.view("absent", &value, &size));
+
+  // Damaged values are caught
+  const ps_offset_t offset = value - ram.address(0, 0);
+  ram.writebyte(offset, value[0] ^ 0x01);
+  TEST_ASSERT_EQUAL(PS_ERROR_CRC, paramStore.view("table", &value, &size));
+
+  // Stores without addressable bytes don't offer views
+  TEST_ASSERT_EQUAL(PS_SUCCESS, ::paramStore.set("table", table, sizeof(table)));
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_ADDRESSABLE, ::paramStore.view("table", &value, &size));
+}
+
+void test_mmap_file_store(void) {
+  char path[] = "/tmp/ps_test_XXXXXX";
+  const int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd>=0);
+  close(fd);
+
+  Datum *data[20];
+  const MmapSync modes[] = { MmapSyncEachWrite, MmapSyncEachOperation, MmapSyncDeferred };
+  for (unsigned m=0; m<ELEMENTS(modes); ++m) {
+    {
+      MmapFileStore file(path, STORE_SIZE, modes[m]);
+      ParameterStore paramStore(file);
+      TEST_ASSERT_TRUE_MESSAGE(paramStore.begin(), "Began file store");
+      if (m==0) {
+        makeTestEntries(paramStore, data, ELEMENTS(data)); // New file starts empty
+      }
+      for (unsigned di = 0; di<ELEMENTS(data); di += 4) {
+        TEST_ASSERT_TRUE(data[di]->randomize()->store(paramStore));
+      }
+      const uint8_t *value;
+      uint16_t size;
+      TEST_ASSERT_EQUAL_MESSAGE(PS_SUCCESS, paramStore.view(data[0]->name(), &value, &size), "File store is addressable");
+    }
+
+    // Values are still there when the file is opened again
+    MmapFileStore file(path, STORE_SIZE);
+    ParameterStore reopened(file);
+    TEST_ASSERT_TRUE_MESSAGE(reopened.begin(), "Reopened file store");
+    for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+      TEST_ASSERT_TRUE_MESSAGE(data[di]->check(reopened), "Read value from reopened file");
+    }
+  }
+  unlink(path);
+
+  // A file that can't be opened leaves no map. Later calls fail without touching it.
+  MmapFileStore missing("/nonexistent/ps_test", STORE_SIZE);
+  ParameterStore unopened(missing);
+  TEST_ASSERT_FALSE(unopened.begin());
+  TEST_ASSERT_FALSE(data[0]->check(unopened));
+  unopened.set("key", (uint32_t)1);
+  uint32_t value = 0;
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, unopened.get("key", &value));
+}
+
+void test_crc32(void) {
+  const uint8_t check[] = "123456789";
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, psCrc32(0, check, 9));
+  TEST_ASSERT_EQUAL_HEX32(0xCBF43926, psCrc32(psCrc32(0, check, 4), check + 4, 5));
+
+  uint8_t bytes[100];
+  for (unsigned i=0; i<sizeof(bytes); ++i) {
+    bytes[i] = rand() % 256;
+  }
+  const uint32_t whole = psCrc32(0, bytes, sizeof(bytes));
+  uint32_t crc = 0;
+  for (unsigned done = 0, chunk = 1; done<sizeof(bytes); done += chunk, chunk = (chunk * 3) % 17 + 1) {
+    crc = psCrc32(crc, bytes + done, MIN(chunk, sizeof(bytes) - done));
+  }
+  TEST_ASSERT_EQUAL_HEX32(whole, crc);
+  bytes[50] ^= 0x04;
+  TEST_ASSERT_FALSE_MESSAGE(whole==psCrc32(0, bytes, sizeof(bytes)), "Single bit flip detected");
+}
+
+#if !defined(PS_32BIT_OFFSETS) && !defined(PS_HASHED_KEYS)
+void test_format1_store(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE(paramStore.begin());
+  // Mark the empty store as format 1
+  byteStore.writeu16(0, 1);
+  ParameterStore legacy(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(legacy.begin(), "Began format 1 store");
+
+  Datum *data[10];
+  makeTestEntries(legacy, data, ELEMENTS(data));
+
+  // Recovery uses the format 1 checksum
+  Datum *d = data[0]->clone()->randomize();
+  TestStore<STORE_SIZE> prechangeStore = byteStore;
+  TEST_ASSERT_TRUE(d->store(legacy));
+  const uint32_t bytesWritten = byteStore.getBytesWritten() - prechangeStore.getBytesWritten();
+  for (uint32_t failAt = 1; failAt<bytesWritten; ++failAt) {
+    TestStore<STORE_SIZE> testStore = prechangeStore;
+    ParameterStore failStore(testStore);
+    TEST_ASSERT_TRUE(failStore.begin());
+    testStore.setFailAfterWritingBytes(failAt);
+    d->store(failStore);
+    testStore.setFailAfterWritingBytes(0);
+    ParameterStore recoverStore(testStore);
+    TEST_ASSERT_TRUE(recoverStore.begin());
+    TEST_ASSERT_TRUE_MESSAGE(d->check(recoverStore) || data[0]->check(recoverStore), "Old or new value");
+  }
+  data[0] = d;
+  TEST_ASSERT_EQUAL(1, byteStore.readu16(0));
+
+  // Deserializing rewrites the store in the current format
+  char buffer[1000];
+  const int size = legacy.serialize(buffer, sizeof(buffer));
+  TEST_ASSERT_TRUE(size>0);
+  legacy.deserialize(buffer, size);
+  TEST_ASSERT_EQUAL(2, byteStore.readu16(0));
+  ParameterStore upgraded(byteStore);
+  TEST_ASSERT_TRUE_MESSAGE(upgraded.begin(), "Began upgraded store");
+  for (unsigned di = 0; di<ELEMENTS(data); ++di) {
+    TEST_ASSERT_TRUE_MESSAGE(data[di]->check(upgraded), "Read value after upgrade");
+  }
+}
+#endif
+
+#if defined(PS_32BIT_OFFSETS)
+static bool findHighest(void *context, const ParameterEntry &entry) {
+  ps_offset_t *highest = (ps_offset_t *)context;
+  *highest = MAX(*highest, entry.offset);
+  return true;
+}
+
+void test_large_store(void) {
+  static TestStore<100000> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE(paramStore.begin());
+
+  // Fill well past 64KB
+  uint8_t value[1300];
+  uint8_t readBack[sizeof(value)];
+  const uint16_t fill = 1000;
+  char key[16];
+  for (int i=0; i<90; ++i) {
+    sprintf(key, "big%02d", i);
+    memset(value, i, fill);
+    TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(key, value, fill));
+  }
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, paramStore.get("absent", readBack, fill));
+
+  // Growing early entries moves them to the end and leaves holes to compact
+  for (int i=1; i<4; ++i) {
+    sprintf(key, "big%02d", i);
+    memset(value, 0x80 + i, fill + 100 * i);
+    TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(key, value, fill + 100 * i));
+  }
+  ps_offset_t before = 0;
+  paramStore.forEach(findHighest, &before);
+  TEST_ASSERT_TRUE(before>0x10000);
+  TEST_ASSERT_TRUE(paramStore.compact());
+  ps_offset_t after = 0;
+  paramStore.forEach(findHighest, &after);
+  TEST_ASSERT_TRUE_MESSAGE(after<before, "Compaction moved entries above 64KB down into the holes");
+
+  ParameterStore reopened(byteStore);
+  TEST_ASSERT_TRUE(reopened.begin());
+  for (int i=0; i<90; ++i) {
+    sprintf(key, "big%02d", i);
+    const uint16_t size = (i>0 && i<4) ? fill + 100 * i : fill;
+    memset(value, (i>0 && i<4) ? 0x80 + i : i, size);
+    TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.get(key, readBack, size));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(value, readBack, size);
+  }
+
+  // A value too large for a 16 bit entry size is refused, even with room in the store
+  static uint8_t huge[0xFFF0]; // With its header and CRC, more than 64KB
+  TEST_ASSERT_EQUAL(PS_INSUFFICIENT_SPACE, reopened.set("huge", huge, sizeof(huge)));
+  TEST_ASSERT_TRUE(reopened.beginTransaction());
+  TEST_ASSERT_EQUAL(PS_INSUFFICIENT_SPACE, reopened.set("huge", huge, sizeof(huge)));
+  reopened.abort();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, reopened.get("big89", readBack, fill));
+}
+#endif
+
+void test_parameter_keys(void) {
+  static constexpr ParameterKey CalibX1("calib_x1");
+  static_assert(CalibX1.hash==hashKey("calib_x1", PS_MAX_KEY_LENGTH), "Literal key hashed at compile time");
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  FixedKeyIndex<16> index;
+  ParameterStore paramStore(byteStore, &index);
+  TEST_ASSERT_TRUE(paramStore.begin());
+
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(CalibX1, (uint32_t)1));
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("calib_x10", (uint32_t)10));
+  uint32_t value = 0;
+#if defined(PS_HASHED_KEYS)
+  // Full names are kept, so keys that share their first 8 characters stay apart
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get(CalibX1, &value));
+  TEST_ASSERT_EQUAL(1, value);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get("calib_x10", &value));
+  TEST_ASSERT_EQUAL(10, value);
+
+  const char *longKey = "a_rather_long_parameter_name";
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set(longKey, (uint32_t)28));
+  char tooLong[PS_MAX_KEY_LENGTH + 2];
+  memset(tooLong, 'k', sizeof(tooLong) - 1);
+  tooLong[sizeof(tooLong) - 1] = '\0';
+  TEST_ASSERT_EQUAL(PS_ERROR_KEY_TOO_LONG, paramStore.set(tooLong, (uint32_t)0));
+
+  // Names survive serializing and a walk without the index
+  char buffer[200];
+  const int size = paramStore.serialize(buffer, sizeof(buffer));
+  TEST_ASSERT_TRUE(size>0);
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "calib_x10="));
+  paramStore.deserialize(buffer, size);
+  ParameterStore walked(byteStore);
+  TEST_ASSERT_TRUE(walked.begin());
+  TEST_ASSERT_EQUAL(PS_SUCCESS, walked.get(longKey, &value));
+  TEST_ASSERT_EQUAL(28, value);
+  TEST_ASSERT_EQUAL(PS_SUCCESS, walked.get("calib_x1", &value));
+  TEST_ASSERT_EQUAL(1, value);
+  TEST_ASSERT_EQUAL(PS_ERROR_NOT_FOUND, walked.get("calib_x", &value));
+#else
+  // Names are cut to 8 characters, so the second set replaced the first
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.get(CalibX1, &value));
+  TEST_ASSERT_EQUAL(10, value);
+  TEST_ASSERT_EQUAL(1, index.count());
+#endif
+}
+
+#if defined(PS_STATS)
+void test_stats(void) {
+  TestStore<STORE_SIZE> byteStore;
+  byteStore.resetStore();
+  ParameterStore paramStore(byteStore);
+  TEST_ASSERT_TRUE(paramStore.begin());
+
+  Datum *data[10];
+  makeTestEntries(paramStore, data, ELEMENTS(data));
+  TEST_ASSERT_EQUAL(ELEMENTS(data), paramStore.stats().sets);
+  TEST_ASSERT_EQUAL(ELEMENTS(data), paramStore.stats().gets);
+
+  paramStore.resetStats();
+  byteStore.resetStats();
+  TEST_ASSERT_TRUE(data[9]->store(paramStore));
+  TEST_ASSERT_EQUAL(1, paramStore.stats().sets);
+  TEST_ASSERT_EQUAL_MESSAGE(1, paramStore.stats().unchanged, "Value already stored");
+  TEST_ASSERT_EQUAL(0, byteStore.stats().writeBytes);
+  TEST_ASSERT_EQUAL(1, paramStore.stats().lookups);
+  TEST_ASSERT_EQUAL(ELEMENTS(data), paramStore.stats().entriesScanned); // Last key is found last
+  TEST_ASSERT_EQUAL(0, paramStore.stats().recoveries);
+
+  paramStore.resetStats();
+  byteStore.resetStats();
+  const uint32_t bytesBefore = byteStore.getBytesWritten();
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("stat", (uint32_t)1));
+  TEST_ASSERT_EQUAL(byteStore.getBytesWritten() - bytesBefore, byteStore.stats().writeBytes);
+  TEST_ASSERT_TRUE_MESSAGE(byteStore.stats().writeBytes>paramStore.stats().valueBytes, "Writes include header, plan, and CRC");
+  TEST_ASSERT_EQUAL(PS_SUCCESS, paramStore.set("stat", (uint32_t)2));
+  TEST_ASSERT_EQUAL_MESSAGE(1, paramStore.stats().updates, "Same size value updated in place");
+
+  // Interrupted set is recovered by begin(). Fail just before the plan is cleared.
+  TestStore<STORE_SIZE> measureStore = byteStore;
+  ParameterStore measure(measureStore);
+  TEST_ASSERT_TRUE(measure.begin());
+  const uint32_t measureBefore = measureStore.getBytesWritten();
+  measure.set("stat", (uint32_t)3);
+  byteStore.setFailAfterWritingBytes(measureStore.getBytesWritten() - measureBefore - 1);
+  paramStore.set("stat", (uint32_t)3);
+  byteStore.setFailAfterWritingBytes(0);
+  ParameterStore recovered(byteStore);
+  TEST_ASSERT_TRUE(recovered.begin());
+  TEST_ASSERT_EQUAL(1, recovered.stats().recoveries);
+
+  paramStore.resetStats();
+  TEST_ASSERT_EQUAL(0, paramStore.stats().sets);
+}
+#endif
+
 int main(int argc, char **argv) {
     UNITY_BEGIN();    // IMPORTANT LINE!
 
@@ -422,7 +2184,46 @@ int main(int argc, char **argv) {
     RUN_TEST(test_overwrite);
     RUN_TEST(test_multiple_writes);
     RUN_TEST(test_multiple_writes_with_error);
+    RUN_TEST(test_multiple_writes_with_error_rotating);
+    RUN_TEST(test_reuse_freed_with_error);
     RUN_TEST(test_serialize_deserialize);
+    RUN_TEST(test_serialize_streaming);
+    RUN_TEST(test_deserialize_chunks);
+    RUN_TEST(test_snapshot);
+    RUN_TEST(test_get_many);
+    RUN_TEST(test_for_each);
+    RUN_TEST(test_typed_values);
+    RUN_TEST(test_schema);
+    RUN_TEST(test_rotating_allocation);
+    RUN_TEST(test_in_place_update);
+    RUN_TEST(test_indexed_lookup);
+    RUN_TEST(test_key_index_remove);
+    RUN_TEST(test_multiple_writes_with_error_mapped);
+    RUN_TEST(test_free_space_map);
+    RUN_TEST(test_compact);
+    RUN_TEST(test_compact_mapped);
+    RUN_TEST(test_compact_with_error);
+    RUN_TEST(test_cached_store);
+    RUN_TEST(test_write_back_cache);
+    RUN_TEST(test_vectored_io);
+    RUN_TEST(test_view);
+    RUN_TEST(test_mmap_file_store);
+    RUN_TEST(test_flash_log_store);
+    RUN_TEST(test_transaction);
+    RUN_TEST(test_transaction_mapped);
+    RUN_TEST(test_transaction_with_error);
+    RUN_TEST(test_bulk_load);
+    RUN_TEST(test_crc32);
+#if !defined(PS_32BIT_OFFSETS) && !defined(PS_HASHED_KEYS)
+    RUN_TEST(test_format1_store);
+#endif
+#if defined(PS_32BIT_OFFSETS)
+    RUN_TEST(test_large_store);
+#endif
+    RUN_TEST(test_parameter_keys);
+#if defined(PS_STATS)
+    RUN_TEST(test_stats);
+#endif
 
     // setup();
 